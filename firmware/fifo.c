@@ -2,6 +2,12 @@
 #include <fx2delay.h>
 #include "glasgow.h"
 
+// Endpoints (by index, EP2 being 0) whose flags are asserted early, i.e. with _OEP1 set for OUT
+// endpoints or _INFM1 set for IN endpoints.
+static uint8_t fifo_early_eps;
+
+#define FIFO_EARLY(idx, bit) ((fifo_early_eps & (1 << (idx))) ? (bit) : 0)
+
 void fifo_init() {
   // Use newest chip features.
   SYNCDELAY;
@@ -15,19 +21,19 @@ void fifo_init() {
   FIFORESET = _NAKALL;
 
   // Configure strobes and flags.
-  // All flags are configured as RDY; this means ~EF for OUT endpoints and ~FF for IN endpoints.
   // SLRD and SLWR *must* be configured as active low; otherwise, when the FPGA I/Os are
   // internally pulled up during reset, spurious reads and writes will happen.
   SYNCDELAY;
   FIFOPINPOLAR = 0;
-  SYNCDELAY;
-  PINFLAGSAB = 0b10011000; // FLAGA = EP2 ~EF, FLAGB = EP4 ~EF
-  SYNCDELAY;
-  PINFLAGSCD = 0b11111110; // FLAGC = EP6 ~FF, FLAGD = EP8 ~FF
+  fifo_reset_flags();
   SYNCDELAY;
   PORTACFG |= _FLAGD; // PA7 is FLAGD
 
-  // Use 8-bit wide bus.
+  // Use 8-bit wide bus. A 16-bit bus is not possible: FD[15:8] share pins with port D, which
+  // drives the LEDs and the I/O power enables on every revision, and is not connected to
+  // the FPGA. Setting _WORDWIDE on any endpoint would hand port D to the FIFO bus. The 8-bit bus
+  // is not a bottleneck anyway, since at 48 MHz IFCLK it carries more data than high-speed bulk
+  // endpoints can.
   SYNCDELAY;
   EP2FIFOCFG &= ~_WORDWIDE;
   SYNCDELAY;
@@ -38,77 +44,90 @@ void fifo_init() {
   EP8FIFOCFG &= ~_WORDWIDE;
 }
 
-void fifo_configure(bool two_ep) {
-  uint8_t ep26buf, ep48valid;
-  if(two_ep) {
-    ep26buf   = 0;      // quad buffered
-    ep48valid = 0;      // invalid
-  } else {
-    ep26buf   = _BUF1;  // double buffered
-    ep48valid = _VALID; // valid
-  }
+// Endpoint configurations for each FIFO layout, in the order EP2, EP4, EP6, EP8. The FX2 only
+// supports a few ways to divide the 4 KB of endpoint buffer memory, and each layout is one of
+// them; EP4 and EP8 are always double-buffered, and are invalid when their memory is used for
+// deeper or larger buffers of EP2 or EP6.
+static __code const uint8_t fifo_layout_cfgs[][4] = {
+  [FIFO_LAYOUT_2_PIPES] = {
+    _VALID|_TYPE1|_BUF1,      _VALID|_TYPE1,  _VALID|_DIR|_TYPE1|_BUF1, _VALID|_DIR|_TYPE1,
+  },
+  [FIFO_LAYOUT_1_PIPE] = {
+    _VALID|_TYPE1,            _TYPE1,         _VALID|_DIR|_TYPE1,       _DIR|_TYPE1,
+  },
+  [FIFO_LAYOUT_DEEP_IN] = {
+    _VALID|_TYPE1|_BUF1,      _VALID|_TYPE1,  _VALID|_DIR|_TYPE1,       _DIR|_TYPE1,
+  },
+  [FIFO_LAYOUT_DEEP_OUT] = {
+    _VALID|_TYPE1,            _TYPE1,         _VALID|_DIR|_TYPE1|_BUF1, _VALID|_DIR|_TYPE1,
+  },
+  [FIFO_LAYOUT_ISO_IN] = {
+    _VALID|_TYPE1|_BUF1,      _TYPE1,         _VALID|_DIR|_TYPE0|_SIZE|_BUF1, _DIR|_TYPE1,
+  },
+};
+
+uint8_t fifo_layout;
+
+void fifo_configure(uint8_t layout) {
+  __code const uint8_t *cfgs = fifo_layout_cfgs[layout];
+  fifo_layout = layout;
 
   // Disable all FIFOs.
   SYNCDELAY;
   FIFORESET = _NAKALL;
 
-  // Configure EP2.
+  // Configure endpoints; all of them are BULK 512B, except for EP6IN in FIFO_LAYOUT_ISO_IN.
   SYNCDELAY;
-  EP2CFG = _VALID|_TYPE1|ep26buf; // OUT BULK 512B
-
-  // Configure EP4.
+  EP2CFG = cfgs[0];
   SYNCDELAY;
-  EP4CFG = ep48valid|_TYPE1; // OUT BULK 512B
-
-  // Configure EP6.
+  EP4CFG = cfgs[1];
+  SYNCDELAY;
+  EP6CFG = cfgs[2];
   SYNCDELAY;
-  EP6CFG = _VALID|_DIR|_TYPE1|ep26buf; // IN BULK 512B
+  EP8CFG = cfgs[3];
 
-  // Configure EP8.
+  // An isochronous EP6IN sends a packet from each of its two buffers in every microframe;
+  // a third packet would find the first buffer still being refilled.
   SYNCDELAY;
-  EP8CFG = ep48valid|_DIR|_TYPE1; // IN BULK 512B
+  EP6ISOINPKTS = (cfgs[2] & _SIZE) ? _INPPF1 : _INPPF0;
 
   // Reset and configure endpoints.
-  fifo_reset(two_ep, two_ep ? 0x1 : 0x3);
+  fifo_reset(0x3);
 
   // Enable FIFOs.
   SYNCDELAY;
   FIFORESET = 0;
 }
 
-void fifo_reset(bool two_ep, uint8_t interfaces) {
+void fifo_reset(uint8_t interfaces) {
+  fifo_flush(interfaces, FIFO_DIR_OUT|FIFO_DIR_IN);
+}
+
+void fifo_flush(uint8_t interfaces, uint8_t directions) {
+  __code const uint8_t *cfgs = fifo_layout_cfgs[fifo_layout];
+
   // For the following code, note that for FIFORESET and OUTPKTEND to do anything,
   // the endpoints *must* be in manual mode (_AUTOIN/_AUTOOUT bits cleared).
 
-  if(interfaces & (1 << 0)) {
+  if((interfaces & (1 << 0)) && (directions & FIFO_DIR_OUT)) {
     // Reset EP2OUT.
+    fifo_take_ep2();
     SYNCDELAY;
-    EP2FIFOCFG = 0;
-    SYNCDELAY;
-    FIFORESET |= 2;
-    SYNCDELAY;
-    OUTPKTEND = _SKIP|2;
-    SYNCDELAY;
-    OUTPKTEND = _SKIP|2;
-    if(two_ep) {
-      SYNCDELAY;
-      OUTPKTEND = _SKIP|2;
-      SYNCDELAY;
-      OUTPKTEND = _SKIP|2;
-    }
-    SYNCDELAY;
-    EP2FIFOCFG = _AUTOOUT;
+    EP2FIFOCFG = _AUTOOUT|FIFO_EARLY(0, _OEP1);
+  }
 
+  if((interfaces & (1 << 0)) && (directions & FIFO_DIR_IN)) {
     // Reset EP6IN.
     SYNCDELAY;
     EP6FIFOCFG = 0;
     SYNCDELAY;
     FIFORESET |= 6;
     SYNCDELAY;
-    EP6FIFOCFG = _ZEROLENIN;
+    EP6FIFOCFG = _ZEROLENIN|FIFO_EARLY(2, _INFM1);
   }
 
-  if(interfaces & (1 << 1)) {
+  // In some layouts, interface 1 has only one of EP4OUT and EP8IN.
+  if((interfaces & (1 << 1)) && (directions & FIFO_DIR_OUT) && (cfgs[1] & _VALID)) {
     // Reset EP4OUT.
     SYNCDELAY;
     EP4FIFOCFG = 0;
@@ -119,14 +138,94 @@ void fifo_reset(bool two_ep, uint8_t interfaces) {
     SYNCDELAY;
     OUTPKTEND = _SKIP|4;
     SYNCDELAY;
-    EP4FIFOCFG = _AUTOOUT;
+    EP4FIFOCFG = _AUTOOUT|FIFO_EARLY(1, _OEP1);
+  }
 
+  if((interfaces & (1 << 1)) && (directions & FIFO_DIR_IN) && (cfgs[3] & _VALID)) {
     // Reset EP8IN.
     SYNCDELAY;
     EP8FIFOCFG = 0;
     SYNCDELAY;
     FIFORESET |= 8;
     SYNCDELAY;
-    EP8FIFOCFG = _ZEROLENIN;
+    EP8FIFOCFG = _ZEROLENIN|FIFO_EARLY(3, _INFM1);
+  }
+}
+
+void fifo_take_ep2() {
+  // Switch EP2OUT to manual mode and discard any packets it holds. Afterwards, the CPU can
+  // consume packets through EP2FIFOBUF and release them with OUTPKTEND; resetting interface 0
+  // returns EP2OUT to the FIFO bus.
+  SYNCDELAY;
+  EP2FIFOCFG = 0;
+  SYNCDELAY;
+  FIFORESET |= 2;
+  SYNCDELAY;
+  OUTPKTEND = _SKIP|2;
+  SYNCDELAY;
+  OUTPKTEND = _SKIP|2;
+  if(!(fifo_layout_cfgs[fifo_layout][0] & _BUF1)) { // quad-buffered
+    SYNCDELAY;
+    OUTPKTEND = _SKIP|2;
+    SYNCDELAY;
+    OUTPKTEND = _SKIP|2;
   }
 }
+
+void fifo_reset_flags() {
+  uint8_t idx;
+
+  // All flags are configured as RDY; this means ~EF for OUT endpoints and ~FF for IN endpoints.
+  fifo_early_eps = 0;
+  for(idx = 0; idx < 4; idx++) {
+    SYNCDELAY;
+    (&EP2FIFOCFG)[idx] &= ~(_OEP1|_INFM1);
+  }
+  SYNCDELAY;
+  PINFLAGSAB = 0b10011000; // FLAGA = EP2 ~EF, FLAGB = EP4 ~EF
+  SYNCDELAY;
+  PINFLAGSCD = 0b11111110; // FLAGC = EP6 ~FF, FLAGD = EP8 ~FF
+}
+
+bool fifo_set_flag(uint8_t ep, bool programmable, bool early, uint16_t level) {
+  // FLAGA..FLAGD belong to EP2..EP8. EP2 and EP4 are always OUT endpoints, and EP6 and EP8 are
+  // always IN endpoints.
+  uint8_t idx = (ep - 2) >> 1;
+  uint8_t flag, bit_early;
+  __xdata volatile uint8_t *pinflags;
+
+  if(ep < 2 || ep > 8 || (ep & 1))
+    return false;
+
+  if(programmable) {
+    flag = 0b0100|idx; // EPx PF
+  } else if(idx < 2) {
+    flag = 0b1000|idx; // EPx ~EF
+  } else {
+    flag = 0b1100|idx; // EPx ~FF
+  }
+  bit_early = (idx < 2) ? _OEP1 : _INFM1;
+
+  // The level has the layout of EPxFIFOPFH:EPxFIFOPFL, which differs between IN and OUT
+  // endpoints; it is up to the host to encode it.
+  SYNCDELAY;
+  (&EP2FIFOPFH)[idx * 2] = level >> 8;
+  SYNCDELAY;
+  (&EP2FIFOPFL)[idx * 2] = level & 0xff;
+
+  if(early)
+    fifo_early_eps |=  (1 << idx);
+  else
+    fifo_early_eps &= ~(1 << idx);
+  SYNCDELAY;
+  (&EP2FIFOCFG)[idx] = ((&EP2FIFOCFG)[idx] & ~bit_early) | (early ? bit_early : 0);
+
+  pinflags = (idx < 2) ? &PINFLAGSAB : &PINFLAGSCD;
+  SYNCDELAY;
+  if(idx & 1)
+    *pinflags = (*pinflags & 0x0f) | (flag << 4);
+  else
+    *pinflags = (*pinflags & 0xf0) | flag;
+
+  return true;
+}
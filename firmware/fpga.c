@@ -1,3 +1,4 @@
+#include <fx2lib.h>
 #include <fx2regs.h>
 #include <fx2delay.h>
 #include <fx2i2c.h>
@@ -13,15 +14,78 @@ static bool fpga_check_ready() {
   }
 }
 
+// Number of literal bytes remaining in the run being expanded by fpga_load_rle().
+static uint8_t rle_literal_len;
+
+__xdata uint32_t fpga_phase_ticks[FPGA_PHASE_COUNT];
+static __xdata uint32_t fpga_phase_begin;
+
+static void fpga_phase_end(uint8_t phase) {
+  uint32_t now = timer_ticks();
+  fpga_phase_ticks[phase] = now - fpga_phase_begin;
+  fpga_phase_begin = now;
+}
+
+// Shadow copies of the registers declared by the host.
+static uint8_t reg_shadow_count;
+
+// GPIF is not used, so its waveform memory is free to hold the shadow copies. The values are
+// stored in the order they are read, which is the reverse of the order they are written.
+static __xdata __at(0xE400) struct {
+  uint8_t   addr[REG_SHADOW_COUNT];
+  uint8_t   length[REG_SHADOW_COUNT]; // 0 if the value is not known
+  uint8_t   value[REG_SHADOW_COUNT][REG_SHADOW_SIZE];
+} reg_shadow;
+
+// Registers sampled periodically by the main loop, if there are any.
+static uint8_t reg_sample_count;
+
+// Number of samples dropped because the ring was full since the host last drained it.
+uint16_t fpga_reg_sample_overflows;
+
+#define REG_SAMPLE_RING_SIZE 128
+
+// The state is kept in the rest of GPIF waveform memory after the shadow copies. Scratch RAM
+// cannot be used, since it is overwritten whenever a USB descriptor is sent.
+static __xdata __at(0xE400 + REG_SHADOW_COUNT * (2 + REG_SHADOW_SIZE)) struct {
+  uint32_t  period;
+  uint32_t  next;
+  uint8_t   addr[REG_SAMPLE_COUNT];
+  uint8_t   width[REG_SAMPLE_COUNT];
+  uint8_t   record_len;
+  uint8_t   ring_len;
+  uint8_t   head;
+  uint8_t   tail;
+  uint8_t   used;
+} reg_sample;
+
+// Each sample is a record with the timer value followed by the values of the registers.
+// The ring only ever holds whole records, and its length is a multiple of the record length,
+// so a record is never split at the end of the ring and can be read into it directly.
+static __xdata uint8_t reg_sample_ring[REG_SAMPLE_RING_SIZE];
+
 void fpga_init() {
   OED |=  (1<<PIND_LED_ICE);
   fpga_check_ready();
+
+  reg_sample.record_len = 4;
+  reg_sample.used       = 0;
 }
 
 void fpga_reset() {
-  // Disable FIFO bus.
+  fpga_phase_begin = timer_ticks();
+
+  // Discard any partially expanded compressed bitstream.
+  rle_literal_len = 0;
+
+  // The registers of the next bitstream are unrelated to the ones of the previous one.
+  reg_shadow_count = 0;
+  reg_sample_count = 0;
+
+  // Disable FIFO bus. The next bitstream may expect different FIFO flags than the previous one.
   SYNCDELAY;
   IFCONFIG &= ~(_IFCFG1|_IFCFG0);
+  fifo_reset_flags();
 
   // Put FPGA in reset.
   switch(glasgow_config.revision) {
@@ -63,15 +127,21 @@ void fpga_reset() {
 
   // Update FPGA status.
   fpga_check_ready();
+  fpga_phase_end(FPGA_PHASE_RESET);
 }
 
 void fpga_load(__xdata uint8_t *data, uint8_t len) {
   data;
   len;
 
-  // 8c/bit -> 6 MHz SCLK @ 48 MHz CLKOUT
-#define BIT(bit) \
-  mov  c, acc+bit      /*2c*/ \
+  // 7c/bit -> 6.9 MHz SCLK @ 48 MHz CLKOUT
+  // Shifting the byte through the carry flag is one cycle shorter than addressing
+  // the accumulator bits individually (`mov c, acc.N`, 8c/bit). With the 5c of per-byte
+  // overhead (`movx`, `djnz`), a byte takes 61c instead of 69c, so SRAM configuration is
+  // about 1.13x faster, not 2x. The 6c of port writes per bit cannot be shortened, since SCK
+  // and SI are plain PORTB pins with no shift engine behind them.
+#define BIT \
+  rlc  a               /*1c*/ \
   clr  _IOB+PINB_SCK   /*2c*/ \
   mov  _IOB+PINB_SI, c /*2c*/ \
   setb _IOB+PINB_SCK   /*2c*/
@@ -95,22 +165,151 @@ __asm
 
 00000$:
   movx a, @dptr
-  BIT(7)
-  BIT(6)
-  BIT(5)
-  BIT(4)
-  BIT(3)
-  BIT(2)
-  BIT(1)
-  BIT(0)
+  BIT // 7
+  BIT // 6
+  BIT // 5
+  BIT // 4
+  BIT // 3
+  BIT // 2
+  BIT // 1
+  BIT // 0
   djnz r0, 00000$
 __endasm;
+}
+
+void fpga_load_byte(uint8_t data) {
+  data;
+
+  // Unlike fpga_load(), this does not use the autopointers, which may be used by
+  // the USB interrupt handlers.
+__asm
+  mov  a, _DPL0
+  BIT // 7
+  BIT // 6
+  BIT // 5
+  BIT // 4
+  BIT // 3
+  BIT // 2
+  BIT // 1
+  BIT // 0
+__endasm;
 #undef  BIT
 }
 
-bool fpga_start() {
+void fpga_load_zero(uint8_t len) {
+  len;
+
+  // 4c/bit; SI is held low and only SCK is toggled
+#define BIT \
+  clr  _IOB+PINB_SCK   /*2c*/ \
+  setb _IOB+PINB_SCK   /*2c*/
+
 __asm
-  mov  a, #49
+  clr  _IOB+PINB_SI
+  mov  r0, _DPL0
+
+00002$:
+  BIT // 7
+  BIT // 6
+  BIT // 5
+  BIT // 4
+  BIT // 3
+  BIT // 2
+  BIT // 1
+  BIT // 0
+  djnz r0, 00002$
+__endasm;
+#undef  BIT
+}
+
+void fpga_load_rle(__xdata uint8_t *data, uint8_t len) {
+  // The compressed bitstream is a sequence of runs. A header byte 0x00-0x7f is followed by
+  // 1 to 128 literal bytes, and a header byte 0x80-0xff stands for 1 to 128 zero bytes.
+  // Runs may be split across any number of calls.
+  while(len > 0) {
+    if(rle_literal_len == 0) {
+      uint8_t header = *data++;
+      len--;
+
+      if(header & 0x80)
+        fpga_load_zero((header & 0x7f) + 1);
+      else
+        rle_literal_len = header + 1;
+    } else {
+      uint8_t chunk_len = len < rle_literal_len ? len : rle_literal_len;
+      fpga_load(data, chunk_len);
+
+      data += chunk_len;
+      len  -= chunk_len;
+      rle_literal_len -= chunk_len;
+    }
+  }
+}
+
+void fpga_load_rle_byte(uint8_t data) {
+  // Same as fpga_load_rle(), for a single byte.
+  if(rle_literal_len == 0) {
+    if(data & 0x80)
+      fpga_load_zero((data & 0x7f) + 1);
+    else
+      rle_literal_len = data + 1;
+  } else {
+    fpga_load_byte(data);
+    rle_literal_len--;
+  }
+}
+
+bool fpga_load_eeprom(uint8_t chip, uint16_t addr, uint16_t len, bool rle) {
+  __xdata uint8_t data[2];
+
+  if(len == 0)
+    return true;
+
+  data[0] = addr >> 8;
+  data[1] = addr & 0xff;
+  if(!i2c_start(chip<<1))
+    goto fail;
+  if(!i2c_write(data, 2))
+    goto fail;
+  if(!i2c_start((chip<<1)|1))
+    goto fail;
+
+  // Reading I2DAT starts reception of the next byte, so each byte is shifted into the FPGA
+  // while the I2C controller is receiving the one after it. The EEPROM increments the address
+  // on its own, across page boundaries, but wraps around at the end of the 64 KiB logical chip,
+  // so the caller must not read across 0x10000.
+  if(len == 1)
+    I2CS |= _LASTRD;
+  data[0] = I2DAT;
+  while(len > 0) {
+    while(!(I2CS & _DONE));
+    if(I2CS & _BERR)
+      return false;
+
+    len--;
+    if(len == 1)
+      I2CS |= _LASTRD;
+    if(len == 0)
+      I2CS |= _STOP;
+
+    if(rle)
+      fpga_load_rle_byte(I2DAT);
+    else
+      fpga_load_byte(I2DAT);
+  }
+  while(I2CS & _STOP);
+  return true;
+
+fail:
+  i2c_stop();
+  return false;
+}
+
+static void fpga_clock(uint8_t count) {
+  count;
+
+__asm
+  mov  a, _DPL0
 
 00001$:
   // 8c/bit
@@ -119,6 +318,18 @@ __asm
   setb _IOB+PINB_SCK   /*2c*/
   djnz acc, 00001$     /*3c*/
 __endasm;
+}
+
+bool fpga_start() {
+  uint8_t timeout = 255;
+
+  fpga_phase_end(FPGA_PHASE_LOAD);
+
+  // CDONE goes high once the FPGA has processed the entire bitstream, which takes a few clocks
+  // after the last bit; then, at least 49 more clocks are needed to activate the user I/O.
+  while(!(IOA & (1<<PINA_CDONE)) && --timeout)
+    fpga_clock(8);
+  fpga_clock(49);
 
   // Tristate PORTB drivers as FPGA may drive them now.
   OEB &= ~((1<<PINB_SCK)|(1<<PINB_SS_N)|(1<<PINB_SI));
@@ -137,6 +348,8 @@ __endasm;
       break;
   }
 
+  fpga_phase_end(FPGA_PHASE_START);
+
   // Update and return FPGA status.
   return fpga_check_ready();
 }
@@ -170,9 +383,51 @@ fail:
 }
 
 bool fpga_reg_write(__xdata const uint8_t *value, uint8_t length) {
+  return fpga_reg_write_seq(value, length, /*last=*/true);
+}
+
+// Read `length` bytes out of `remaining` bytes left in a register read that spans several calls.
+// The read is started if `first` is set, and finished once no bytes remain.
+bool fpga_reg_read_seq(__xdata uint8_t *value, uint8_t length, uint16_t remaining, bool first) {
+  if(first) {
+    if(!i2c_start((I2C_ADDR_FPGA<<1)|1))
+      goto fail;
+
+    // Reading I2DAT starts reception of the next byte.
+    if(remaining == 1)
+      I2CS |= _LASTRD;
+    value[0] = I2DAT;
+  }
+
+  while(length > 0) {
+    while(!(I2CS & _DONE));
+    if(I2CS & _BERR)
+      return false;
+
+    remaining--;
+    if(remaining == 1)
+      I2CS |= _LASTRD;
+    if(remaining == 0)
+      I2CS |= _STOP;
+
+    *value++ = I2DAT;
+    length--;
+  }
+  if(remaining == 0)
+    while(I2CS & _STOP);
+  return true;
+
+fail:
+  i2c_stop();
+  return false;
+}
+
+// Write `length` bytes of a register write that spans several calls, finishing it if `last`
+// is set.
+bool fpga_reg_write_seq(__xdata const uint8_t *value, uint8_t length, bool last) {
   if(!i2c_write(value, length))
     goto fail;
-  if(!i2c_stop())
+  if(last && !i2c_stop())
     return false;
   return true;
 
@@ -180,3 +435,138 @@ fail:
   i2c_stop();
   return false;
 }
+
+// Registers that are only ever changed by the host can be declared, so that reading them back
+// (e.g. for read-modify-write) is served from a copy of the last value written or read, without
+// an I2C transaction. Since the copy is stored as written, the width of such registers should be
+// a multiple of 8 bits.
+void fpga_reg_shadow_declare(__xdata const uint8_t *addrs, uint8_t count) {
+  uint8_t index;
+
+  for(index = 0; index < count; index++) {
+    reg_shadow.addr[index]   = addrs[index];
+    reg_shadow.length[index] = 0;
+  }
+  reg_shadow_count = count;
+}
+
+static uint8_t fpga_reg_shadow_find(uint8_t addr) {
+  uint8_t index;
+
+  for(index = 0; index < reg_shadow_count; index++) {
+    if(reg_shadow.addr[index] == addr)
+      return index;
+  }
+  return 0xff;
+}
+
+bool fpga_reg_shadow_read(uint8_t addr, __xdata uint8_t *value, uint8_t length) {
+  uint8_t index = fpga_reg_shadow_find(addr);
+
+  if(index == 0xff || length == 0 || reg_shadow.length[index] != length)
+    return false;
+  xmemcpy(value, reg_shadow.value[index], length);
+  return true;
+}
+
+// A length of 0 forgets the value, e.g. if the write failed.
+void fpga_reg_shadow_update(uint8_t addr, __xdata const uint8_t *value, uint8_t length,
+                            bool write) {
+  uint8_t index = fpga_reg_shadow_find(addr);
+  uint8_t offset;
+
+  if(index == 0xff)
+    return;
+  if(length > REG_SHADOW_SIZE)
+    length = 0;
+  for(offset = 0; offset < length; offset++)
+    reg_shadow.value[index][offset] = write ? value[length - 1 - offset] : value[offset];
+  reg_shadow.length[index] = length;
+}
+
+// Start sampling the registers described by `count` pairs of address and width in `regs` every
+// `period` timer ticks, discarding any samples that were not taken by the host yet. A count of
+// zero stops sampling.
+bool fpga_reg_sample_start(uint32_t period, __xdata const uint8_t *regs, uint8_t count) {
+  uint8_t index;
+
+  if(count > REG_SAMPLE_COUNT || (count > 0 && period == 0))
+    return false;
+
+  for(index = 0; index < count; index++) {
+    if(regs[index * 2 + 1] == 0 || regs[index * 2 + 1] > REG_SAMPLE_WIDTH)
+      return false;
+  }
+
+  reg_sample.record_len = 4;
+  for(index = 0; index < count; index++) {
+    reg_sample.addr[index]  = regs[index * 2];
+    reg_sample.width[index] = regs[index * 2 + 1];
+    reg_sample.record_len  += reg_sample.width[index];
+  }
+
+  reg_sample.period   = period;
+  reg_sample.next     = timer_ticks();
+  reg_sample.ring_len = REG_SAMPLE_RING_SIZE - REG_SAMPLE_RING_SIZE % reg_sample.record_len;
+  reg_sample.head     = 0;
+  reg_sample.tail     = 0;
+  reg_sample.used     = 0;
+  fpga_reg_sample_overflows = 0;
+  reg_sample_count = count;
+  return true;
+}
+
+// Take a sample if one is due. If the FPGA stops responding, sampling stops as well.
+void fpga_reg_sample_step() {
+  uint32_t now = timer_ticks();
+  __xdata uint8_t *record;
+  uint8_t  index, offset;
+
+  if(reg_sample_count == 0 || (int32_t)(now - reg_sample.next) < 0)
+    return;
+
+  // If sampling fell behind, e.g. during a long request, skip the missed samples instead of
+  // taking them in a burst.
+  reg_sample.next += reg_sample.period;
+  if((int32_t)(now - reg_sample.next) >= 0)
+    reg_sample.next = now + reg_sample.period;
+
+  if(reg_sample.used + reg_sample.record_len > reg_sample.ring_len) {
+    if(fpga_reg_sample_overflows != 0xffff)
+      fpga_reg_sample_overflows++;
+    return;
+  }
+
+  record = reg_sample_ring + reg_sample.head;
+  *(__xdata uint32_t *)record = now;
+  offset = 4;
+  for(index = 0; index < reg_sample_count; index++) {
+    if(!fpga_reg_select(reg_sample.addr[index]) ||
+       !fpga_reg_read(record + offset, reg_sample.width[index])) {
+      reg_sample_count = 0;
+      return;
+    }
+    offset += reg_sample.width[index];
+  }
+
+  reg_sample.head += reg_sample.record_len;
+  if(reg_sample.head == reg_sample.ring_len)
+    reg_sample.head = 0;
+  reg_sample.used += reg_sample.record_len;
+}
+
+// Return the number of bytes in the whole records that are in the ring and fit in `limit`.
+uint16_t fpga_reg_sample_pending(uint16_t limit) {
+  if(limit >= reg_sample.used)
+    return reg_sample.used;
+  return limit - limit % reg_sample.record_len;
+}
+
+void fpga_reg_sample_take(__xdata uint8_t *data, uint8_t length) {
+  reg_sample.used -= length;
+  while(length--) {
+    *data++ = reg_sample_ring[reg_sample.tail];
+    if(++reg_sample.tail == reg_sample.ring_len)
+      reg_sample.tail = 0;
+  }
+}
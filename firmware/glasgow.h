@@ -27,7 +27,7 @@ enum {
 
 enum {
   // API compatibility level
-  CUR_API_LEVEL  = 0x01,
+  CUR_API_LEVEL  = 0x12,
 };
 
 // PORTA pins
@@ -76,7 +76,8 @@ enum {
 #define MAX_VOLTAGE 5500 // mV
 
 // Config API
-#define BITSTREAM_ID_SIZE 16
+#define BITSTREAM_ID_SIZE    16
+#define BITSTREAM_SLOT_COUNT 4
 
 __xdata __at(0x4000 - CONF_SIZE) struct glasgow_config {
   uint8_t   revision;
@@ -84,17 +85,60 @@ __xdata __at(0x4000 - CONF_SIZE) struct glasgow_config {
   uint32_t  bitstream_size;
   char      bitstream_id[BITSTREAM_ID_SIZE];
   uint16_t  voltage_limit[2];
+  // ICE_MEM address of each slot in 256-byte pages, or 0 if the slot is empty.
+  uint16_t  bitstream_slot[BITSTREAM_SLOT_COUNT];
 } glasgow_config;
 
+// Each bitstream slot starts with this header, followed by the compressed bitstream.
+struct bitstream_slot_header {
+  char      bitstream_id[BITSTREAM_ID_SIZE];
+  uint32_t  bitstream_size;
+};
+
 // FPGA API
+enum {
+  // Configuration phases, each timed from the end of the previous one
+  FPGA_PHASE_RESET,
+  FPGA_PHASE_LOAD,
+  FPGA_PHASE_START,
+  FPGA_PHASE_COUNT,
+};
+
+extern __xdata uint32_t fpga_phase_ticks[FPGA_PHASE_COUNT];
+
 void fpga_init();
 void fpga_reset();
 void fpga_load(__xdata uint8_t *data, uint8_t len);
+void fpga_load_byte(uint8_t data);
+void fpga_load_zero(uint8_t len);
+void fpga_load_rle(__xdata uint8_t *data, uint8_t len);
+void fpga_load_rle_byte(uint8_t data);
+bool fpga_load_eeprom(uint8_t chip, uint16_t addr, uint16_t len, bool rle);
 bool fpga_start();
 bool fpga_is_ready();
 bool fpga_reg_select(uint8_t addr);
 bool fpga_reg_read(__xdata uint8_t *value, uint8_t length);
 bool fpga_reg_write(__xdata const uint8_t *value, uint8_t length);
+bool fpga_reg_read_seq(__xdata uint8_t *value, uint8_t length, uint16_t remaining, bool first);
+bool fpga_reg_write_seq(__xdata const uint8_t *value, uint8_t length, bool last);
+
+#define REG_SHADOW_COUNT 16
+#define REG_SHADOW_SIZE  4
+
+void fpga_reg_shadow_declare(__xdata const uint8_t *addrs, uint8_t count);
+bool fpga_reg_shadow_read(uint8_t addr, __xdata uint8_t *value, uint8_t length);
+void fpga_reg_shadow_update(uint8_t addr, __xdata const uint8_t *value, uint8_t length,
+                            bool write);
+
+#define REG_SAMPLE_COUNT 8
+#define REG_SAMPLE_WIDTH 4
+
+extern uint16_t fpga_reg_sample_overflows;
+
+bool fpga_reg_sample_start(uint32_t period, __xdata const uint8_t *regs, uint8_t count);
+void fpga_reg_sample_step();
+uint16_t fpga_reg_sample_pending(uint16_t limit);
+void fpga_reg_sample_take(__xdata uint8_t *data, uint8_t length);
 
 // DAC/LDO API
 void iobuf_init_dac_ldo();
@@ -128,14 +172,44 @@ bool iobuf_set_pull(uint8_t selector, uint8_t enable, uint8_t level);
 bool iobuf_get_pull(uint8_t selector, __xdata uint8_t *enable, __xdata uint8_t *level);
 
 // FIFO API
+enum {
+  // FIFO layouts
+  FIFO_LAYOUT_2_PIPES   = 0, // P at {2x512B EP2OUT/EP6IN}, Q at {2x512B EP4OUT/EP8IN}
+  FIFO_LAYOUT_1_PIPE    = 1, // P at {4x512B EP2OUT/EP6IN}
+  FIFO_LAYOUT_DEEP_IN   = 2, // P at {2x512B EP2OUT, 4x512B EP6IN}, Q at {2x512B EP4OUT}
+  FIFO_LAYOUT_DEEP_OUT  = 3, // P at {4x512B EP2OUT, 2x512B EP6IN}, Q at {2x512B EP8IN}
+  FIFO_LAYOUT_ISO_IN    = 4, // P at {2x512B EP2OUT, 2x1024B isochronous EP6IN}
+};
+
+enum {
+  // FIFO directions
+  FIFO_DIR_OUT          = 1<<0,
+  FIFO_DIR_IN           = 1<<1,
+};
+
+extern uint8_t fifo_layout;
+
 void fifo_init();
-void fifo_configure(bool two_ep);
-void fifo_reset(bool two_ep, uint8_t interfaces);
+void fifo_configure(uint8_t layout);
+void fifo_reset(uint8_t interfaces);
+void fifo_flush(uint8_t interfaces, uint8_t directions);
+void fifo_take_ep2();
+void fifo_reset_flags();
+bool fifo_set_flag(uint8_t ep, bool programmable, bool early, uint16_t level);
+
+// Timer API
+#define TIMER_FREQ 4000000 // Hz
+
+void timer_init();
+uint32_t timer_ticks();
 
 // Util functions
 bool i2c_reg8_read(uint8_t addr, uint8_t reg,
                          __pdata uint8_t *value, uint8_t length);
 bool i2c_reg8_write(uint8_t addr, uint8_t reg,
                           __pdata const uint8_t *value, uint8_t length);
+bool eeprom_write_seq(uint8_t chip, uint16_t addr, __xdata const uint8_t *buf, uint8_t length,
+                      uint8_t page_size, bool first, bool last, uint8_t timeout);
+bool eeprom_wait(uint8_t chip, uint8_t timeout);
 
 #endif
@@ -23,7 +23,7 @@ usb_desc_device_c usb_device = {
   .iManufacturer        = 1,
   .iProduct             = 2,
   .iSerialNumber        = 3,
-  .bNumConfigurations   = 2,
+  .bNumConfigurations   = 6,
 };
 
 usb_desc_device_qualifier_c usb_device_qualifier = {
@@ -59,12 +59,24 @@ usb_desc_interface_c usb_interface_0_double =
 usb_desc_interface_c usb_interface_0_quad =
   USB_INTERFACE(/*bInterfaceNumber=*/0, /*bAlternateSetting=*/1, /*bNumEndpoints=*/2,
                 /*iInterface=*/8);
+usb_desc_interface_c usb_interface_0_asymmetric =
+  USB_INTERFACE(/*bInterfaceNumber=*/0, /*bAlternateSetting=*/1, /*bNumEndpoints=*/2,
+                /*iInterface=*/13);
+usb_desc_interface_c usb_interface_0_isochronous =
+  USB_INTERFACE(/*bInterfaceNumber=*/0, /*bAlternateSetting=*/1, /*bNumEndpoints=*/2,
+                /*iInterface=*/15);
 usb_desc_interface_c usb_interface_1_disabled =
   USB_INTERFACE(/*bInterfaceNumber=*/1, /*bAlternateSetting=*/0, /*bNumEndpoints=*/0,
                 /*iInterface=*/6);
 usb_desc_interface_c usb_interface_1_double =
   USB_INTERFACE(/*bInterfaceNumber=*/1, /*bAlternateSetting=*/1, /*bNumEndpoints=*/2,
                 /*iInterface=*/7);
+usb_desc_interface_c usb_interface_1_registers =
+  USB_INTERFACE(/*bInterfaceNumber=*/1, /*bAlternateSetting=*/1, /*bNumEndpoints=*/2,
+                /*iInterface=*/10);
+usb_desc_interface_c usb_interface_1_simplex =
+  USB_INTERFACE(/*bInterfaceNumber=*/1, /*bAlternateSetting=*/1, /*bNumEndpoints=*/1,
+                /*iInterface=*/7);
 
 #define USB_BULK_ENDPOINT(bEndpointAddress_)                                              \
   {                                                                                       \
@@ -76,6 +88,17 @@ usb_desc_interface_c usb_interface_1_double =
     .bInterval            = 0,                                                            \
   }
 
+// A high-bandwidth isochronous endpoint, transferring two 1024B packets per microframe.
+#define USB_ISO_ENDPOINT(bEndpointAddress_)                                               \
+  {                                                                                       \
+    .bLength              = sizeof(struct usb_desc_endpoint),                             \
+    .bDescriptorType      = USB_DESC_ENDPOINT,                                            \
+    .bEndpointAddress     = bEndpointAddress_,                                            \
+    .bmAttributes         = USB_XFER_ISOCHRONOUS,                                         \
+    .wMaxPacketSize       = (1 << 11)|1024,                                               \
+    .bInterval            = 1,                                                            \
+  }
+
 usb_desc_endpoint_c usb_endpoint_2_out =
   USB_BULK_ENDPOINT(/*bEndpointAddress=*/2|USB_DIR_OUT);
 usb_desc_endpoint_c usb_endpoint_4_out =
@@ -84,6 +107,8 @@ usb_desc_endpoint_c usb_endpoint_6_in =
   USB_BULK_ENDPOINT(/*bEndpointAddress=*/6|USB_DIR_IN );
 usb_desc_endpoint_c usb_endpoint_8_in =
   USB_BULK_ENDPOINT(/*bEndpointAddress=*/8|USB_DIR_IN );
+usb_desc_endpoint_c usb_endpoint_6_in_iso =
+  USB_ISO_ENDPOINT(/*bEndpointAddress=*/6|USB_DIR_IN );
 
 usb_configuration_c usb_config_2_pipes = {
   {
@@ -127,6 +152,100 @@ usb_configuration_c usb_config_1_pipe = {
   }
 };
 
+// The endpoints are the same as in usb_config_2_pipes, but the gateware uses pipe Q to access
+// the FPGA registers instead of the I2C bus.
+usb_configuration_c usb_config_1_pipe_tunnel = {
+  {
+    .bLength              = sizeof(struct usb_desc_configuration),
+    .bDescriptorType      = USB_DESC_CONFIGURATION,
+    .bNumInterfaces       = 2,
+    .bConfigurationValue  = 3,
+    .iConfiguration       = 9,
+    .bmAttributes         = USB_ATTR_RESERVED_1,
+    .bMaxPower            = 250,
+  },
+  {
+    { .interface  = &usb_interface_0_disabled  },
+    { .interface  = &usb_interface_0_double    },
+    { .endpoint   = &usb_endpoint_2_out        },
+    { .endpoint   = &usb_endpoint_6_in         },
+    { .interface  = &usb_interface_1_disabled  },
+    { .interface  = &usb_interface_1_registers },
+    { .endpoint   = &usb_endpoint_4_out        },
+    { .endpoint   = &usb_endpoint_8_in         },
+    { 0 }
+  }
+};
+
+// Capture applets need deep IN buffering and hardly any OUT buffering, and pattern generators
+// need the opposite. If pipe Q is used in one direction only, the endpoint buffer memory of
+// the other direction goes to pipe P instead.
+usb_configuration_c usb_config_2_pipes_deep_in = {
+  {
+    .bLength              = sizeof(struct usb_desc_configuration),
+    .bDescriptorType      = USB_DESC_CONFIGURATION,
+    .bNumInterfaces       = 2,
+    .bConfigurationValue  = 4,
+    .iConfiguration       = 11,
+    .bmAttributes         = USB_ATTR_RESERVED_1,
+    .bMaxPower            = 250,
+  },
+  {
+    { .interface  = &usb_interface_0_disabled   },
+    { .interface  = &usb_interface_0_asymmetric },
+    { .endpoint   = &usb_endpoint_2_out         },
+    { .endpoint   = &usb_endpoint_6_in          },
+    { .interface  = &usb_interface_1_disabled   },
+    { .interface  = &usb_interface_1_simplex    },
+    { .endpoint   = &usb_endpoint_4_out         },
+    { 0 }
+  }
+};
+
+usb_configuration_c usb_config_2_pipes_deep_out = {
+  {
+    .bLength              = sizeof(struct usb_desc_configuration),
+    .bDescriptorType      = USB_DESC_CONFIGURATION,
+    .bNumInterfaces       = 2,
+    .bConfigurationValue  = 5,
+    .iConfiguration       = 12,
+    .bmAttributes         = USB_ATTR_RESERVED_1,
+    .bMaxPower            = 250,
+  },
+  {
+    { .interface  = &usb_interface_0_disabled   },
+    { .interface  = &usb_interface_0_asymmetric },
+    { .endpoint   = &usb_endpoint_2_out         },
+    { .endpoint   = &usb_endpoint_6_in          },
+    { .interface  = &usb_interface_1_disabled   },
+    { .interface  = &usb_interface_1_simplex    },
+    { .endpoint   = &usb_endpoint_8_in          },
+    { 0 }
+  }
+};
+
+// Bulk transfers get whatever bandwidth is left over by other devices on the bus, so captures
+// may overrun when the bus is shared. An isochronous EP6IN has bandwidth reserved for it, and
+// so a guaranteed rate of 16 MB/s, at the cost of packets being lost rather than retried.
+usb_configuration_c usb_config_1_pipe_iso_in = {
+  {
+    .bLength              = sizeof(struct usb_desc_configuration),
+    .bDescriptorType      = USB_DESC_CONFIGURATION,
+    .bNumInterfaces       = 1,
+    .bConfigurationValue  = 6,
+    .iConfiguration       = 14,
+    .bmAttributes         = USB_ATTR_RESERVED_1,
+    .bMaxPower            = 250,
+  },
+  {
+    { .interface  = &usb_interface_0_disabled    },
+    { .interface  = &usb_interface_0_isochronous },
+    { .endpoint   = &usb_endpoint_2_out          },
+    { .endpoint   = &usb_endpoint_6_in_iso       },
+    { 0 }
+  }
+};
+
 // check for "earlier than 3.5", but version macros shipped in 3.6
 #if !defined(__SDCC_VERSION_MAJOR)
 __code const struct usb_configuration *__code const usb_configs[] = {
@@ -135,6 +254,10 @@ usb_configuration_set_c usb_configs[] = {
 #endif
   &usb_config_2_pipes,
   &usb_config_1_pipe,
+  &usb_config_1_pipe_tunnel,
+  &usb_config_2_pipes_deep_in,
+  &usb_config_2_pipes_deep_out,
+  &usb_config_1_pipe_iso_in,
 };
 
 usb_ascii_string_c usb_strings[] = {
@@ -148,6 +271,19 @@ usb_ascii_string_c usb_strings[] = {
   [5] = "Disabled",
   [6] = "Double-buffered 512B",
   [7] = "Quad-buffered 512B",
+  // Configurations
+  [8] = "Pipe P at {2x512B EP2OUT/EP6IN}, registers at {2x512B EP4OUT/EP8IN}",
+  // Interfaces
+  [9] = "Double-buffered 512B register tunnel",
+  // Configurations
+  [10] = "Pipe P at {2x512B EP2OUT, 4x512B EP6IN}, Q at {2x512B EP4OUT}",
+  [11] = "Pipe P at {4x512B EP2OUT, 2x512B EP6IN}, Q at {2x512B EP8IN}",
+  // Interfaces
+  [12] = "Asymmetrically buffered 512B",
+  // Configurations
+  [13] = "Pipe P at {2x512B EP2OUT, 2x1024B isochronous EP6IN}",
+  // Interfaces
+  [14] = "Double-buffered 512B bulk OUT, 1024B isochronous IN",
 };
 
 usb_descriptor_set_c usb_descriptor_set = {
@@ -280,6 +416,17 @@ enum {
   USB_REQ_IOBUF_ENABLE = 0x19,
   USB_REQ_LIMIT_VOLT   = 0x1A,
   USB_REQ_PULL         = 0x1B,
+  USB_REQ_FPGA_CFG_BULK = 0x1C,
+  USB_REQ_BITSTREAM_SLOT = 0x1D,
+  USB_REQ_FPGA_TIMING  = 0x1E,
+  USB_REQ_EEPROM_BULK  = 0x1F,
+  USB_REQ_EEPROM_PAGES = 0x20,
+  USB_REQ_REGISTER_BATCH = 0x21,
+  USB_REQ_REGISTER_POLL = 0x22,
+  USB_REQ_REGISTER_SHADOW = 0x23,
+  USB_REQ_REGISTER_SAMPLE = 0x24,
+  USB_REQ_FIFO_FLAGS   = 0x25,
+  USB_REQ_FIFO_FLUSH   = 0x26,
   // Cypress requests
   USB_REQ_CYPRESS_EEPROM_DB = 0xA9,
   // libfx2 requests
@@ -288,11 +435,29 @@ enum {
   USB_REQ_GET_MS_DESCRIPTOR = 0xC0,
 };
 
+enum {
+  // EEPROM write flags
+  EEPROM_CMP  = 1<<8,
+};
+
+enum {
+  // FIFO flag options
+  FIFO_FLAG_PROGRAMMABLE = 1<<8,
+  FIFO_FLAG_EARLY        = 1<<9,
+};
+
+enum {
+  // Bitstream download flags
+  CFG_RLE     = 1<<0,
+  CFG_FLASH   = 1<<1,
+};
+
 enum {
   // Status bits
   ST_ERROR    = 1<<0,
   ST_FPGA_RDY = 1<<1,
   ST_ALERT    = 1<<2,
+  ST_FPGA_CFG = 1<<3,
 };
 
 // We use a self-clearing error latch. That is, when an error condition occurs,
@@ -346,8 +511,12 @@ uint8_t usb_alt_setting[2];
 bool handle_usb_set_configuration(uint8_t config_value) {
   switch(config_value) {
     case 0: break;
-    case 1: fifo_configure(/*two_ep=*/false); break;
-    case 2: fifo_configure(/*two_ep=*/true);  break;
+    case 1: fifo_configure(FIFO_LAYOUT_2_PIPES);  break;
+    case 2: fifo_configure(FIFO_LAYOUT_1_PIPE);   break;
+    case 3: fifo_configure(FIFO_LAYOUT_2_PIPES);  break;
+    case 4: fifo_configure(FIFO_LAYOUT_DEEP_IN);  break;
+    case 5: fifo_configure(FIFO_LAYOUT_DEEP_OUT); break;
+    case 6: fifo_configure(FIFO_LAYOUT_ISO_IN);   break;
     default: return false;
   }
 
@@ -360,17 +529,12 @@ bool handle_usb_set_configuration(uint8_t config_value) {
 }
 
 bool handle_usb_set_interface(uint8_t interface, uint8_t alt_setting) {
-  bool two_ep;
-
-  switch(usb_config_value) {
-    case 1: two_ep = false; break;
-    case 2: two_ep = true;  break;
-    default: return false;
-  }
+  if(usb_config_value == 0)
+    return false;
 
   if(alt_setting == 1) {
     // The interface is being (re)activated, so reset the FIFOs.
-    fifo_reset(two_ep, (1 << interface));
+    fifo_reset(1 << interface);
   }
 
   usb_alt_setting[interface] = alt_setting;
@@ -384,407 +548,1228 @@ void handle_usb_get_interface(uint8_t interface) {
   SETUP_EP0_BUF(1);
 }
 
+// Reconfiguring the FPGA leaves the endpoint configuration and data toggles intact, so that
+// the host can keep using the pipes it has open without selecting the interfaces again. Only
+// the data left in the FIFOs of active interfaces, which belongs to the previous bitstream,
+// is discarded, before the FIFO bus is re-enabled.
+static bool fpga_start_keep_pipes() {
+  if(usb_config_value != 0) {
+    fifo_reset((usb_alt_setting[0] == 1 ? 1 << 0 : 0) |
+               (usb_alt_setting[1] == 1 ? 1 << 1 : 0));
+  }
+  return fpga_start();
+}
+
 // This monotonically increasing number ensures that we upload bitstream chunks
 // strictly in order.
 uint16_t bitstream_idx;
 
-void handle_pending_usb_setup() {
-  __xdata struct usb_req_setup *req = (__xdata struct usb_req_setup *)SETUPDAT;
+// Bitstreams stored in EEPROM are loaded from the main loop, one chunk at a time, since loading
+// them over I2C can take a few seconds. While a bitstream is being loaded, the number of bytes
+// remaining is nonzero.
+static uint32_t bitstream_load_length;
+static uint8_t  bitstream_load_chip;
+static uint16_t bitstream_load_addr;
+static bool     bitstream_load_rle;
+
+static void bitstream_load_start(uint8_t chip, uint16_t addr, uint32_t length, bool rle) {
+  bitstream_load_length = length;
+  bitstream_load_chip   = chip;
+  bitstream_load_addr   = addr;
+  bitstream_load_rle    = rle;
+
+  IOD |=  (1<<PIND_LED_ACT);
+  fpga_reset();
+}
 
-  // EEPROM read/write requests
-  if(req->bmRequestType == (USB_RECIP_DEVICE|USB_TYPE_VENDOR|USB_DIR_OUT) &&
-     req->bRequest == USB_REQ_LIBFX2_PAGE_SIZE) {
-    pending_setup = false;
+static void bitstream_load_advance(uint16_t len) {
+  bitstream_load_addr += len;
+  if(bitstream_load_addr == 0) {
+    // Advance to the next logical chip in case of address wraparound.
+    bitstream_load_chip += 1;
+    if(bitstream_load_chip == I2C_ADDR_ICE_MEM + 2) {
+      // See explanation in USB_REQ_EEPROM.
+      bitstream_load_chip  = I2C_ADDR_FX2_MEM;
+      bitstream_load_addr += 0x7000;
+    }
+  }
+}
 
-    // We have built-in knowledge of correct page sizes, ignore any supplied value.
-    ACK_EP0();
-    return;
+static void bitstream_load_step() {
+  uint16_t chunk_len = 0x200;
+  if(bitstream_load_length < chunk_len)
+    chunk_len = bitstream_load_length;
+  // Each logical chip spans 64 KiB, and a sequential read wraps around to address 0 of
+  // the same chip at 0x10000 instead of continuing into the next one, so a chunk must end there;
+  // bitstream_load_advance() then moves on to the next chip.
+  if(bitstream_load_addr != 0 && chunk_len > (uint16_t)-bitstream_load_addr)
+    chunk_len = -bitstream_load_addr;
+
+  if(!fpga_load_eeprom(bitstream_load_chip, bitstream_load_addr, chunk_len,
+                       bitstream_load_rle)) {
+    latch_status_bit(ST_ERROR);
+    memset(glasgow_config.bitstream_id, 0, BITSTREAM_ID_SIZE);
+    bitstream_load_length = 0;
+  } else {
+    bitstream_load_length -= chunk_len;
+    bitstream_load_advance(chunk_len);
+
+    if(bitstream_load_length == 0) {
+      if(!fpga_start_keep_pipes()) {
+        latch_status_bit(ST_ERROR);
+        memset(glasgow_config.bitstream_id, 0, BITSTREAM_ID_SIZE);
+      }
+    }
+  }
+
+  if(bitstream_load_length == 0)
+    IOD &= ~(1<<PIND_LED_ACT);
+}
+
+static void ep6_commit(uint16_t len) {
+  SYNCDELAY;
+  EP6BCH = len >> 8;
+  SYNCDELAY;
+  EP6BCL = len & 0xff;
+}
+
+// Read `len` bytes at `addr` from EEPROM `chip` into EP6IN packets, with one sequential read.
+// The EEPROM increments the address on its own, across page boundaries. If the read fails,
+// a short packet ends the transfer on the host.
+static bool eeprom_read_ep6(uint8_t chip, uint16_t addr, uint32_t len) {
+  __xdata uint8_t addr_bytes[2];
+  uint16_t packet_len = 0;
+
+  addr_bytes[0] = addr >> 8;
+  addr_bytes[1] = addr & 0xff;
+  if(!i2c_start(chip<<1) ||
+     !i2c_write(addr_bytes, 2) ||
+     !i2c_start((chip<<1)|1)) {
+    i2c_stop();
+    goto fail;
   }
 
-  if((req->bmRequestType == (USB_RECIP_DEVICE|USB_TYPE_VENDOR|USB_DIR_IN) ||
-      req->bmRequestType == (USB_RECIP_DEVICE|USB_TYPE_VENDOR|USB_DIR_OUT)) &&
-     (req->bRequest == USB_REQ_CYPRESS_EEPROM_DB ||
-      req->bRequest == USB_REQ_EEPROM)) {
-    bool     arg_read = (req->bmRequestType & USB_DIR_IN);
-    uint8_t  arg_chip = 0;
-    uint16_t arg_addr = req->wValue;
-    uint16_t arg_len  = req->wLength;
-    uint8_t  page_size = 0;
-    uint8_t  timeout   = 255; // 5 ms
-    if(req->bRequest == USB_REQ_CYPRESS_EEPROM_DB) {
-      arg_chip = I2C_ADDR_FX2_MEM;
-    } else /* req->bRequest == USB_REQ_EEPROM */ {
-      switch(req->wIndex) {
-        case 0:
+  // Reading I2DAT starts reception of the next byte.
+  if(len == 1)
+    I2CS |= _LASTRD;
+  addr_bytes[0] = I2DAT;
+  while(len > 0) {
+    while(packet_len == 0 && (EP2468STAT & _EP6F)) {
+      if(pending_setup) {
+        // The host gave up on the transfer. Receive one more byte, not acknowledging it,
+        // and end the read.
+        I2CS |= _LASTRD;
+        while(!(I2CS & _DONE));
+        addr_bytes[0] = I2DAT;
+        while(!(I2CS & _DONE));
+        I2CS |= _STOP;
+        addr_bytes[0] = I2DAT;
+        while(I2CS & _STOP);
+        return false;
+      }
+    }
+
+    while(!(I2CS & _DONE));
+    if(I2CS & _BERR)
+      goto fail;
+
+    len--;
+    if(len == 1)
+      I2CS |= _LASTRD;
+    if(len == 0)
+      I2CS |= _STOP;
+
+    EP6FIFOBUF[packet_len++] = I2DAT;
+    if(packet_len == 512 || len == 0) {
+      ep6_commit(packet_len);
+      packet_len = 0;
+    }
+  }
+  while(I2CS & _STOP);
+  return true;
+
+fail:
+  ep6_commit(packet_len);
+  return false;
+}
+
+// EP1 is disabled, so its buffers are free to hold a chunk of data while EP0 receives
+// the next one, and to compare it with EEPROM contents.
+#define chunk_buf EP1OUTBUF
+#define cmp_buf   EP1INBUF
+
+// Number of EEPROM pages written by the last USB_REQ_EEPROM write request.
+static uint16_t eeprom_pages_written;
+
+// Results of the last USB_REQ_REGISTER_BATCH operation list, which are kept in EP1INBUF
+// until the host reads them, or until cmp_buf is used, which discards them.
+#define reg_batch_buf EP1INBUF
+static uint8_t reg_batch_len;
+
+// Condition waited for by the next USB_REQ_REGISTER_POLL IN request.
+static __xdata struct {
+  uint8_t   addr;
+  uint8_t   mask;
+  uint8_t   value;
+  uint16_t  interval_us;
+  uint16_t  timeout_ms;
+} reg_poll;
+
+// State of the USB_REQ_REGISTER_POLL IN request being served by register_poll_step(), if any.
+static bool     reg_poll_active;
+static uint16_t reg_poll_iterations;
+static uint32_t reg_poll_started;
+static uint32_t reg_poll_last;
+
+// libfx2 EEPROM page size request
+static bool handle_libfx2_page_size() {
+  pending_setup = false;
+
+  // We have built-in knowledge of correct page sizes, ignore any supplied value.
+  ACK_EP0();
+  return true;
+}
+
+// EEPROM read/write requests
+static bool handle_eeprom() {
+  __xdata struct usb_req_setup *req = (__xdata struct usb_req_setup *)SETUPDAT;
+  bool     arg_read = (req->bmRequestType & USB_DIR_IN);
+  bool     arg_cmp  = (req->bRequest == USB_REQ_EEPROM && (req->wIndex & EEPROM_CMP));
+  uint8_t  arg_chip = 0;
+  uint16_t arg_addr = req->wValue;
+  uint16_t arg_len  = req->wLength;
+  uint8_t  page_size = 0;
+  uint16_t page_mask;
+  uint8_t  timeout   = 255; // 5 ms
+  bool     open      = false;
+  if(req->bRequest == USB_REQ_CYPRESS_EEPROM_DB) {
+    arg_chip  = I2C_ADDR_FX2_MEM;
+    page_size = 6; // 64 bytes
+  } else /* req->bRequest == USB_REQ_EEPROM */ {
+    switch(req->wIndex & 0xff) {
+      case 0:
+        arg_chip  = I2C_ADDR_FX2_MEM;
+        page_size = 6; // 64 bytes
+        break;
+      case 1:
+        arg_chip  = I2C_ADDR_ICE_MEM;
+        page_size = 8; // 256 bytes
+        break;
+      case 2:
+        // Same chip, different I2C address for the top half.
+        arg_chip  = I2C_ADDR_ICE_MEM + 1;
+        page_size = 8;
+        break;
+      case 3:
+        // The HX8K bitstream is slightly (less than 4 KB) larger than the capacity of ICE_MEM,
+        // so we stuff the very tail end of the bitstream back into FX2_MEM. It's necessary to
+        // make sure the writes don't wrap, or we can overwrite the configuration info.
+        if(arg_addr <= 0x1000 && arg_len <= 0x1000 && (arg_addr + arg_len) <= 0x1000) {
           arg_chip  = I2C_ADDR_FX2_MEM;
           page_size = 6; // 64 bytes
+          arg_addr += 0x7000;
+        }
+    }
+  }
+  // Writing to the memory the stored bitstream is being loaded from would feed the FPGA a mix
+  // of the old and the new bitstream, so such writes are left pending, and so are NAKed, until
+  // the load completes. (Like requests with SETUP_FPGA, but only for the affected chips.)
+  if(!arg_read && req->bRequest == USB_REQ_EEPROM && (req->wIndex & 0xff) != 0 &&
+     bitstream_load_length > 0)
+    return true;
+  pending_setup = false;
+
+  if(!arg_chip) {
+    STALL_EP0();
+    return true;
+  }
+
+  // Writes are pipelined. Each chunk is copied out of EP0BUF, and EP0 is re-armed before
+  // the chunk is written, so that the next chunk is received while the EEPROM is busy. A page
+  // write spans as many chunks as there are in the page, so that there are as few write
+  // cycles as possible.
+  //
+  // In compare mode, a page write is only started once a chunk differs from the EEPROM
+  // contents, and then continues to the end of the page, since the EEPROM cannot be read
+  // in the middle of a page write.
+  page_mask = (1 << page_size) - 1;
+  if(!arg_read) {
+    eeprom_pages_written = 0;
+    if(arg_len > 0)
+      SETUP_EP0_BUF(0);
+  }
+  while(arg_len > 0) {
+    uint8_t chunk_len = arg_len < 64 ? arg_len : 64;
+
+    if(arg_read) {
+      while(EP0CS & _BUSY);
+      if(!eeprom_read(arg_chip, arg_addr, EP0BUF, chunk_len, /*double_byte=*/true)) {
+        STALL_EP0();
+        break;
+      }
+      SETUP_EP0_BUF(chunk_len);
+    } else {
+      while(EP0CS & _BUSY);
+      xmemcpy(chunk_buf, EP0BUF, chunk_len);
+      if(arg_len > chunk_len)
+        SETUP_EP0_BUF(0);
+
+      if(arg_cmp && !open) {
+        // The comparison reuses the buffer holding USB_REQ_REGISTER_BATCH results.
+        reg_batch_len = 0;
+        if(!eeprom_wait(arg_chip, timeout) ||
+           !eeprom_read(arg_chip, arg_addr, cmp_buf, chunk_len, /*double_byte=*/true)) {
+          STALL_EP0();
           break;
-        case 1:
-          arg_chip  = I2C_ADDR_ICE_MEM;
-          page_size = 8; // 256 bytes
-          break;
-        case 2:
-          // Same chip, different I2C address for the top half.
-          arg_chip  = I2C_ADDR_ICE_MEM + 1;
-          page_size = 8;
-          break;
-        case 3:
-          // The HX8K bitstream is slightly (less than 4 KB) larger than the capacity of ICE_MEM,
-          // so we stuff the very tail end of the bitstream back into FX2_MEM. It's necessary to
-          // make sure the writes don't wrap, or we can overwrite the configuration info.
-          if(arg_addr <= 0x1000 && arg_len <= 0x1000 && (arg_addr + arg_len) <= 0x1000) {
-            arg_chip  = I2C_ADDR_FX2_MEM;
-            page_size = 6; // 64 bytes
-            arg_addr += 0x7000;
-          }
+        }
+        if(memcmp(chunk_buf, cmp_buf, chunk_len) == 0)
+          goto next_chunk;
+      }
+
+      if(!open)
+        eeprom_pages_written++;
+      if((arg_addr & page_mask) + chunk_len > page_mask + 1)
+        eeprom_pages_written++;
+      if(!eeprom_write_seq(arg_chip, arg_addr, chunk_buf, chunk_len, page_size,
+                           /*first=*/!open, /*last=*/arg_len == chunk_len, timeout)) {
+        STALL_EP0();
+        break;
+      }
+      open = ((arg_addr + chunk_len) & page_mask) != 0;
+
+    next_chunk:
+      if(arg_len == chunk_len && !eeprom_wait(arg_chip, timeout)) {
+        STALL_EP0();
+        break;
       }
     }
-    pending_setup = false;
 
-    if(!arg_chip) {
-      STALL_EP0();
-      return;
+    arg_len  -= chunk_len;
+    arg_addr += chunk_len;
+  }
+
+  return true;
+}
+
+// EEPROM bulk read request
+static bool handle_eeprom_bulk() {
+  __xdata struct usb_req_setup *req = (__xdata struct usb_req_setup *)SETUPDAT;
+  uint8_t  arg_idx  = req->wIndex;
+  uint16_t arg_addr = req->wValue;
+  uint32_t arg_len;
+  uint8_t  ifconfig;
+  pending_setup = false;
+
+  // The data is sent to EP6IN, which must be active and a bulk endpoint. Only the chips
+  // themselves can be read this way (see USB_REQ_EEPROM for the meaning of the index).
+  if(usb_config_value == 0 || usb_alt_setting[0] != 1 || fifo_layout == FIFO_LAYOUT_ISO_IN ||
+     arg_idx > 2) {
+    STALL_EP0();
+    return true;
+  }
+
+  SETUP_EP0_BUF(0);
+  while(EP0CS & _BUSY);
+  arg_len = *(__xdata uint32_t *)EP0BUF;
+
+  // A sequential read wraps around at the end of the chip instead of continuing into
+  // the next one, so the read must not cross it. An empty read would leave the I2C bus in
+  // the middle of receiving a byte, since the read is only ended after the last one.
+  if(arg_len == 0 || (uint32_t)arg_addr + arg_len > 0x10000) {
+    STALL_EP0();
+    return true;
+  }
+
+  // Take the FIFO bus off EP6IN, so that the FPGA cannot put data in the packets.
+  ifconfig = IFCONFIG;
+  SYNCDELAY;
+  IFCONFIG = ifconfig & ~(_IFCFG1|_IFCFG0);
+  SYNCDELAY;
+  EP6FIFOCFG = 0;
+  SYNCDELAY;
+  FIFORESET |= 6;
+
+  if(!eeprom_read_ep6(arg_idx == 0 ? I2C_ADDR_FX2_MEM : I2C_ADDR_ICE_MEM + arg_idx - 1,
+                      arg_addr, arg_len)) {
+    latch_status_bit(ST_ERROR);
+  }
+
+  // Wait until the host has read the last packet, and return EP6IN to the FIFO bus.
+  while(!(EP2468STAT & _EP6E) && !pending_setup);
+  fifo_reset(1 << 0);
+  SYNCDELAY;
+  IFCONFIG = ifconfig;
+  return true;
+}
+
+// EEPROM written page count request
+static bool handle_eeprom_pages() {
+  pending_setup = false;
+
+  while(EP0CS & _BUSY);
+  *(__xdata uint16_t *)EP0BUF = eeprom_pages_written;
+  SETUP_EP0_BUF(2);
+
+  return true;
+}
+
+// FPGA register read/write requests
+static bool handle_register() {
+  __xdata struct usb_req_setup *req = (__xdata struct usb_req_setup *)SETUPDAT;
+  bool     arg_read = (req->bmRequestType & USB_DIR_IN);
+  uint8_t  arg_addr = req->wValue;
+  uint16_t arg_len  = req->wLength;
+  bool     first    = true;
+  pending_setup = false;
+
+  if(arg_read) {
+    while(EP0CS & _BUSY);
+    if(arg_len <= REG_SHADOW_SIZE && fpga_reg_shadow_read(arg_addr, EP0BUF, arg_len)) {
+      SETUP_EP0_BUF(arg_len);
+      return true;
     }
+  }
+
+  if(!fpga_reg_select(arg_addr)) {
+    STALL_EP0();
+    return true;
+  }
 
+  // Registers wider than one packet are transferred with a single I2C transaction that spans
+  // several packets. Only registers that fit in a shadow copy update it.
+  if(arg_read) {
+    if(arg_len == 0) {
+      i2c_stop();
+      SETUP_EP0_BUF(0);
+    }
     while(arg_len > 0) {
       uint8_t chunk_len = arg_len < 64 ? arg_len : 64;
 
-      if(arg_read) {
-        while(EP0CS & _BUSY);
-        if(!eeprom_read(arg_chip, arg_addr, EP0BUF, chunk_len, /*double_byte=*/true)) {
-          STALL_EP0();
-          break;
-        }
-        SETUP_EP0_BUF(chunk_len);
-      } else {
+      while(EP0CS & _BUSY);
+      if(!fpga_reg_read_seq(EP0BUF, chunk_len, arg_len, first)) {
+        STALL_EP0();
+        break;
+      }
+      if(first && arg_len <= REG_SHADOW_SIZE)
+        fpga_reg_shadow_update(arg_addr, EP0BUF, arg_len, /*write=*/false);
+      SETUP_EP0_BUF(chunk_len);
+
+      first    = false;
+      arg_len -= chunk_len;
+    }
+  } else {
+    SETUP_EP0_BUF(0);
+    if(arg_len == 0)
+      i2c_stop();
+    while(arg_len > 0) {
+      uint8_t chunk_len = arg_len < 64 ? arg_len : 64;
+
+      // Copy each chunk out of EP0BUF and re-arm EP0, so that the next one is received while
+      // this one is written.
+      while(EP0CS & _BUSY);
+      if(arg_len > chunk_len) {
+        xmemcpy(chunk_buf, EP0BUF, chunk_len);
         SETUP_EP0_BUF(0);
-        while(EP0CS & _BUSY);
-        if(!eeprom_write(arg_chip, arg_addr, EP0BUF, chunk_len, /*double_byte=*/true,
-                         page_size, timeout)) {
+        if(!fpga_reg_write_seq(chunk_buf, chunk_len, /*last=*/false)) {
           STALL_EP0();
           break;
         }
+      } else {
+        if(!fpga_reg_write_seq(EP0BUF, chunk_len, /*last=*/true))
+          chunk_len = 0;
+        fpga_reg_shadow_update(arg_addr, EP0BUF, first ? chunk_len : 0, /*write=*/true);
+        break;
       }
 
-      arg_len  -= chunk_len;
-      arg_addr += chunk_len;
+      first    = false;
+      arg_len -= chunk_len;
     }
+  }
 
-    return;
+  return true;
+}
+
+// FPGA register batch request
+static bool handle_register_batch() {
+  __xdata struct usb_req_setup *req = (__xdata struct usb_req_setup *)SETUPDAT;
+  bool     arg_get = (req->bmRequestType & USB_DIR_IN);
+  uint8_t  arg_len = req->wLength;
+  uint8_t  offset, addr, width;
+  bool     read, ack;
+  pending_setup = false;
+
+  if(arg_get) {
+    if(arg_len > reg_batch_len)
+      arg_len = reg_batch_len;
+    while(EP0CS & _BUSY);
+    xmemcpy(EP0BUF, reg_batch_buf, arg_len);
+    SETUP_EP0_BUF(arg_len);
+    return true;
   }
 
-  // FPGA register read/write requests
-  if((req->bmRequestType == (USB_RECIP_DEVICE|USB_TYPE_VENDOR|USB_DIR_IN) ||
-      req->bmRequestType == (USB_RECIP_DEVICE|USB_TYPE_VENDOR|USB_DIR_OUT)) &&
-     req->bRequest == USB_REQ_REGISTER) {
-    bool     arg_read = (req->bmRequestType & USB_DIR_IN);
-    uint8_t  arg_addr = req->wValue;
-    uint16_t arg_len  = req->wLength;
-    pending_setup = false;
-
-    if(fpga_reg_select(arg_addr)) {
-      if(arg_read) {
-        while(EP0CS & _BUSY);
-        if(fpga_reg_read(EP0BUF, arg_len)) {
-          SETUP_EP0_BUF(arg_len);
-          return;
-        }
-      } else {
-        SETUP_EP0_BUF(0);
-        while(EP0CS & _BUSY);
-        fpga_reg_write(EP0BUF, arg_len);
-        return;
+  SETUP_EP0_BUF(0);
+  while(EP0CS & _BUSY);
+  xmemcpy(chunk_buf, EP0BUF, arg_len);
+
+  // Each operation is an address byte and a width byte, which has the top bit set for reads,
+  // followed by the value for writes. Each operation produces a byte that is 1 if the FPGA
+  // acknowledged it and 0 otherwise, followed by the value for reads.
+  reg_batch_len = 0;
+  for(offset = 0; offset < arg_len; ) {
+    if(offset + 2 > arg_len) {
+      // A trailing byte that is not a complete operation.
+      latch_status_bit(ST_ERROR);
+      reg_batch_len = 0;
+      break;
+    }
+    addr  = chunk_buf[offset++];
+    width = chunk_buf[offset++];
+    read  = width & 0x80;
+    width = width & 0x7f;
+    if(width == 0 ||
+       (read && reg_batch_len + 1 + width > 64) ||
+       (!read && (reg_batch_len + 1 > 64 || offset + width > arg_len))) {
+      latch_status_bit(ST_ERROR);
+      reg_batch_len = 0;
+      break;
+    }
+
+    if(read) {
+      ack = fpga_reg_shadow_read(addr, reg_batch_buf + reg_batch_len + 1, width);
+      if(!ack) {
+        ack = fpga_reg_select(addr) &&
+              fpga_reg_read(reg_batch_buf + reg_batch_len + 1, width);
+        if(ack)
+          fpga_reg_shadow_update(addr, reg_batch_buf + reg_batch_len + 1, width,
+                                 /*write=*/false);
       }
+      reg_batch_buf[reg_batch_len] = ack;
+      reg_batch_len += 1 + width;
+    } else {
+      ack = fpga_reg_select(addr) &&
+            fpga_reg_write(chunk_buf + offset, width);
+      fpga_reg_shadow_update(addr, chunk_buf + offset, ack ? width : 0, /*write=*/true);
+      reg_batch_buf[reg_batch_len] = ack;
+      reg_batch_len += 1;
+      offset += width;
     }
+  }
+
+  return true;
+}
+
+// FPGA register shadow declaration request
+static bool handle_register_shadow() {
+  __xdata struct usb_req_setup *req = (__xdata struct usb_req_setup *)SETUPDAT;
+  uint8_t arg_len = req->wLength;
+  pending_setup = false;
+
+  SETUP_EP0_BUF(0);
+  while(EP0CS & _BUSY);
+  fpga_reg_shadow_declare(EP0BUF, arg_len);
+
+  return true;
+}
+
+// FPGA register poll request
+static bool handle_register_poll() {
+  __xdata struct usb_req_setup *req = (__xdata struct usb_req_setup *)SETUPDAT;
+  bool     arg_get = (req->bmRequestType & USB_DIR_IN);
+
+  if(req->wLength != (arg_get ? 3 : sizeof(reg_poll)))
+    return false;
+  pending_setup = false;
+
+  if(!arg_get) {
+    SETUP_EP0_BUF(0);
+    while(EP0CS & _BUSY);
+    xmemcpy((__xdata void *)&reg_poll, EP0BUF, sizeof(reg_poll));
+    return true;
+  }
+
+  // The register is polled by the main loop, so that a stored bitstream load or register
+  // sampling keeps going while the condition is waited for.
+  reg_poll_active     = true;
+  reg_poll_iterations = 0;
+  reg_poll_started    = timer_ticks();
+  return true;
+}
+
+// Read the register once if the poll interval has passed, and complete the pending
+// USB_REQ_REGISTER_POLL IN request with the last value read and the number of reads if
+// the condition holds or the timeout expires.
+static void register_poll_step() {
+  uint32_t now = timer_ticks();
+
+  if(reg_poll_iterations > 0 &&
+     now - reg_poll_last < (uint32_t)reg_poll.interval_us * (TIMER_FREQ / 1000000))
+    return;
+  reg_poll_last = now;
 
+  while(EP0CS & _BUSY);
+  if(!fpga_reg_select(reg_poll.addr) || !fpga_reg_read(EP0BUF, 1)) {
+    reg_poll_active = false;
     STALL_EP0();
     return;
   }
+  reg_poll_iterations++;
+
+  if((EP0BUF[0] & reg_poll.mask) != reg_poll.value &&
+     now - reg_poll_started < (uint32_t)reg_poll.timeout_ms * (TIMER_FREQ / 1000))
+    return;
 
-  // Device status request
-  if((req->bmRequestType == (USB_RECIP_DEVICE|USB_TYPE_VENDOR|USB_DIR_IN)) &&
-     req->bRequest == USB_REQ_STATUS &&
-     req->wLength == 1) {
-    pending_setup = false;
+  reg_poll_active = false;
+  EP0BUF[1] = reg_poll_iterations & 0xff;
+  EP0BUF[2] = reg_poll_iterations >> 8;
+  SETUP_EP0_BUF(3);
+}
 
+// FPGA register sampling request
+static bool handle_register_sample() {
+  __xdata struct usb_req_setup *req = (__xdata struct usb_req_setup *)SETUPDAT;
+  bool     arg_get = (req->bmRequestType & USB_DIR_IN);
+  uint16_t arg_len = req->wLength;
+  uint16_t pending;
+  uint8_t  packet_len;
+
+  if(!arg_get &&
+     (req->wLength < 4 || req->wLength > 4 + REG_SAMPLE_COUNT * 2 || req->wLength % 2 != 0))
+    return false;
+  pending_setup = false;
+
+  if(!arg_get) {
+    SETUP_EP0_BUF(0);
     while(EP0CS & _BUSY);
-    EP0BUF[0] = status |
-      (fpga_is_ready() ? ST_FPGA_RDY : 0);
-    SETUP_EP0_BUF(1);
+    if(!fpga_reg_sample_start(*(__xdata uint32_t *)EP0BUF, EP0BUF + 4, (arg_len - 4) / 2))
+      latch_status_bit(ST_ERROR);
+    return true;
+  }
 
-    reset_status_bit(ST_ERROR);
+  // Return the number of samples dropped since the last request, followed by as many whole
+  // samples as fit in the rest of the transfer.
+  pending = fpga_reg_sample_pending(arg_len - 2);
+  while(EP0CS & _BUSY);
+  *(__xdata uint16_t *)EP0BUF = fpga_reg_sample_overflows;
+  fpga_reg_sample_overflows = 0;
+  packet_len = 2;
+  while(1) {
+    uint8_t chunk_len = 64 - packet_len;
+    if(chunk_len > pending)
+      chunk_len = pending;
+    fpga_reg_sample_take(EP0BUF + packet_len, chunk_len);
+    pending    -= chunk_len;
+    packet_len += chunk_len;
+
+    SETUP_EP0_BUF(packet_len);
+    arg_len -= packet_len;
+    if(packet_len < 64 || arg_len == 0)
+      break;
+
+    packet_len = 0;
+    while(EP0CS & _BUSY);
+  }
 
-    return;
+  return true;
+}
+
+// Device status request
+static bool handle_status() {
+  pending_setup = false;
+
+  while(EP0CS & _BUSY);
+  EP0BUF[0] = status |
+    (fpga_is_ready() ? ST_FPGA_RDY : 0) |
+    (bitstream_load_length > 0 ? ST_FPGA_CFG : 0);
+  SETUP_EP0_BUF(1);
+
+  reset_status_bit(ST_ERROR);
+
+  return true;
+}
+
+// Bitstream download request
+static bool handle_fpga_cfg() {
+  __xdata struct usb_req_setup *req = (__xdata struct usb_req_setup *)SETUPDAT;
+  bool     arg_rle = req->wValue & CFG_RLE;
+  uint16_t arg_idx = req->wIndex;
+  uint16_t arg_len = req->wLength;
+
+  if(arg_idx != 0 && arg_idx != bitstream_idx + 1)
+    return false;
+  pending_setup = false;
+
+  if(arg_idx == 0) {
+    // Downloading a bitstream supersedes loading a stored one.
+    bitstream_load_length = 0;
+    memset(glasgow_config.bitstream_id, 0, BITSTREAM_ID_SIZE);
+    fpga_reset();
   }
 
-  // Bitstream download request
-  if(req->bmRequestType == (USB_RECIP_DEVICE|USB_TYPE_VENDOR|USB_DIR_OUT) &&
-     req->bRequest == USB_REQ_FPGA_CFG &&
-     (req->wIndex == 0 || req->wIndex == bitstream_idx + 1)) {
-    uint16_t arg_idx = req->wIndex;
-    uint16_t arg_len = req->wLength;
-    pending_setup = false;
+  // Each chunk is copied out of EP0BUF, and EP0 is re-armed before the chunk is shifted out,
+  // so that the next chunk is received while the current one is being shifted.
+  if(arg_len > 0)
+    SETUP_EP0_BUF(0);
+  while(arg_len > 0) {
+    uint8_t chunk_len = arg_len < 64 ? arg_len : 64;
+
+    while(EP0CS & _BUSY);
+    xmemcpy(chunk_buf, EP0BUF, chunk_len);
+
+    arg_len -= chunk_len;
+    if(arg_len > 0)
+      SETUP_EP0_BUF(0);
 
-    if(arg_idx == 0) {
-      memset(glasgow_config.bitstream_id, 0, BITSTREAM_ID_SIZE);
-      fpga_reset();
+    if(arg_rle)
+      fpga_load_rle(chunk_buf, chunk_len);
+    else
+      fpga_load(chunk_buf, chunk_len);
+  }
+
+  bitstream_idx = arg_idx;
+  return true;
+}
+
+// Bitstream bulk download request
+static bool handle_fpga_cfg_bulk() {
+  __xdata struct usb_req_setup *req = (__xdata struct usb_req_setup *)SETUPDAT;
+  bool     arg_rle   = req->wValue & CFG_RLE;
+  bool     arg_flash = req->wValue & CFG_FLASH;
+  uint32_t arg_len;
+
+  if(req->wLength != (arg_flash ? 4 + BITSTREAM_ID_SIZE : 4))
+    return false;
+  pending_setup = false;
+
+  // The bitstream is sent to EP2OUT, which must be active. Flashed bitstreams are loaded
+  // uncompressed, so they must be sent that way too.
+  if(usb_config_value == 0 || usb_alt_setting[0] != 1 || (arg_flash && arg_rle)) {
+    STALL_EP0();
+    return true;
+  }
+
+  bitstream_load_length = 0;
+  memset(glasgow_config.bitstream_id, 0, BITSTREAM_ID_SIZE);
+  fpga_reset();
+
+  // The FIFO bus is idle while the FPGA is in reset, so the CPU can consume EP2OUT packets
+  // directly. This must be done before the data stage completes, since the host will start
+  // sending the bitstream right after that.
+  fifo_take_ep2();
+
+  SETUP_EP0_BUF(0);
+  while(EP0CS & _BUSY);
+  arg_len = *(__xdata uint32_t *)EP0BUF;
+
+  if(arg_flash) {
+    // The bitstream size and ID are adjacent in the configuration block, and are updated
+    // once the entire bitstream is flashed. Until then, the flashed bitstream is marked as
+    // absent, so that a partially written one is never loaded.
+    xmemcpy(chunk_buf, EP0BUF, 4 + BITSTREAM_ID_SIZE);
+    memset(EP0BUF, 0, 4 + BITSTREAM_ID_SIZE);
+    if(!eeprom_write(I2C_ADDR_FX2_MEM,
+                     8 + 4 + __builtin_offsetof(struct glasgow_config, bitstream_size),
+                     EP0BUF, 4 + BITSTREAM_ID_SIZE,
+                     /*double_byte=*/true, /*page_size=*/6, /*timeout=*/255)) {
+      latch_status_bit(ST_ERROR);
+      arg_flash = false;
     }
+    bitstream_load_chip = I2C_ADDR_ICE_MEM;
+    bitstream_load_addr = 0;
+  }
 
-    while(arg_len > 0) {
-      uint8_t chunk_len = arg_len < 64 ? arg_len : 64;
+  while(arg_len > 0) {
+    uint16_t packet_len, offset, chunk_len, page_left, load_offset;
+    uint8_t  page_size, load_len;
 
-      SETUP_EP0_BUF(0);
-      while(EP0CS & _BUSY);
-      fpga_load(EP0BUF, chunk_len);
+    while(EP2CS & _EMPTY) {
+      // If the host sends another request instead of the bitstream, give up; the FPGA
+      // stays in reset.
+      if(pending_setup)
+        break;
+    }
+    if(EP2CS & _EMPTY) {
+      latch_status_bit(ST_ERROR);
+      break;
+    }
 
-      arg_len -= chunk_len;
+    packet_len = (EP2BCH << 8) | EP2BCL;
+    if(packet_len > arg_len)
+      packet_len = arg_len;
+    for(offset = 0; offset < packet_len; offset += chunk_len) {
+      chunk_len = packet_len - offset;
+      if(arg_flash) {
+        // Each chunk ends at an EEPROM page boundary (which is also where a logical chip
+        // ends), and is shifted into the FPGA during the write cycle of that page. The page
+        // write is started only at the first byte of the bitstream or of a page, and is left
+        // open across packets until the page or the bitstream ends.
+        page_size  = (bitstream_load_chip == I2C_ADDR_FX2_MEM) ? 6 : 8;
+        page_left  = 1 << page_size;
+        page_left -= bitstream_load_addr & (page_left - 1);
+        if(chunk_len > page_left)
+          chunk_len = page_left;
+        if(!eeprom_write_seq(bitstream_load_chip, bitstream_load_addr,
+                             EP2FIFOBUF + offset, chunk_len, page_size,
+                             /*first=*/bitstream_load_chip == I2C_ADDR_ICE_MEM &&
+                                       bitstream_load_addr == 0,
+                             /*last=*/arg_len == offset + chunk_len,
+                             /*timeout=*/255)) {
+          latch_status_bit(ST_ERROR);
+          arg_flash = false;
+        }
+        bitstream_load_advance(chunk_len);
+      }
+      for(load_offset = 0; load_offset < chunk_len; load_offset += load_len) {
+        load_len = chunk_len - load_offset < 0x80 ? chunk_len - load_offset : 0x80;
+        if(arg_rle)
+          fpga_load_rle(EP2FIFOBUF + offset + load_offset, load_len);
+        else
+          fpga_load(EP2FIFOBUF + offset + load_offset, load_len);
+      }
     }
 
-    bitstream_idx = arg_idx;
-    return;
+    SYNCDELAY;
+    OUTPKTEND = _SKIP|2;
+
+    arg_len -= packet_len;
   }
 
-  // Bitstream ID get/set request
-  if((req->bmRequestType == (USB_RECIP_DEVICE|USB_TYPE_VENDOR|USB_DIR_IN) ||
-      req->bmRequestType == (USB_RECIP_DEVICE|USB_TYPE_VENDOR|USB_DIR_OUT)) &&
-     req->bRequest == USB_REQ_BITSTREAM_ID &&
-     req->wLength == BITSTREAM_ID_SIZE) {
-    bool arg_get = (req->bmRequestType & USB_DIR_IN);
-    pending_setup = false;
+  // If the bitstream was cut short in the middle of a page, the page write is still open.
+  // Ending it writes a partial page, which is harmless, since the flashed bitstream stays
+  // marked as absent.
+  if(arg_flash && arg_len > 0 &&
+     (bitstream_load_addr & (bitstream_load_chip == I2C_ADDR_FX2_MEM ? 0x3f : 0xff)) != 0)
+    i2c_stop();
+
+  if(arg_flash && arg_len == 0) {
+    // ICE_MEM and FX2_MEM may both still be completing their last write cycle.
+    if(!eeprom_wait(I2C_ADDR_ICE_MEM, /*timeout=*/255) ||
+       !eeprom_wait(I2C_ADDR_FX2_MEM, /*timeout=*/255) ||
+       !eeprom_write(I2C_ADDR_FX2_MEM,
+                     8 + 4 + __builtin_offsetof(struct glasgow_config, bitstream_size),
+                     chunk_buf, 4 + BITSTREAM_ID_SIZE,
+                     /*double_byte=*/true, /*page_size=*/6, /*timeout=*/255))
+      latch_status_bit(ST_ERROR);
+  }
+
+  // Return EP2OUT to the FIFO bus.
+  fifo_reset(1 << 0);
+  return true;
+}
+
+// Bitstream slot load request
+static bool handle_bitstream_slot() {
+  __xdata struct usb_req_setup *req = (__xdata struct usb_req_setup *)SETUPDAT;
+  uint8_t  arg_slot = req->wIndex;
+  __xdata uint16_t slot_page;
+  __xdata struct bitstream_slot_header *header =
+    (__xdata struct bitstream_slot_header *)chunk_buf;
+  pending_setup = false;
+
+  SETUP_EP0_BUF(0);
+  while(EP0CS & _BUSY);
+
+  // The slot table is read from EEPROM rather than from the configuration block in RAM,
+  // so that slots written since the last reset can be loaded. The slot is only loaded if
+  // it contains the bitstream the host asked for.
+  if(arg_slot >= BITSTREAM_SLOT_COUNT ||
+     !eeprom_read(I2C_ADDR_FX2_MEM,
+                  8 + 4 + __builtin_offsetof(struct glasgow_config, bitstream_slot) +
+                    arg_slot * sizeof(uint16_t),
+                  (__xdata void *)&slot_page, sizeof(slot_page), /*double_byte=*/true) ||
+     slot_page == 0 ||
+     !eeprom_read(I2C_ADDR_ICE_MEM + (slot_page >> 8), slot_page << 8,
+                  (__xdata void *)header, sizeof(struct bitstream_slot_header),
+                  /*double_byte=*/true) ||
+     memcmp(header->bitstream_id, EP0BUF, BITSTREAM_ID_SIZE) != 0) {
+    latch_status_bit(ST_ERROR);
+    return true;
+  }
+
+  xmemcpy(glasgow_config.bitstream_id, EP0BUF, BITSTREAM_ID_SIZE);
+  bitstream_load_start(I2C_ADDR_ICE_MEM + (slot_page >> 8),
+                       (slot_page << 8) + sizeof(struct bitstream_slot_header),
+                       header->bitstream_size, /*rle=*/true);
+  return true;
+}
+
+// FPGA configuration timing request
+static bool handle_fpga_timing() {
+  pending_setup = false;
+
+  while(EP0CS & _BUSY);
+  xmemcpy(EP0BUF, (__xdata void *)fpga_phase_ticks, sizeof(fpga_phase_ticks));
+  SETUP_EP0_BUF(sizeof(fpga_phase_ticks));
+
+  return true;
+}
 
-    if(arg_get) {
+// Bitstream ID get/set request
+static bool handle_bitstream_id() {
+  __xdata struct usb_req_setup *req = (__xdata struct usb_req_setup *)SETUPDAT;
+  bool arg_get = (req->bmRequestType & USB_DIR_IN);
+  pending_setup = false;
+
+  if(arg_get) {
+    while(EP0CS & _BUSY);
+    xmemcpy(EP0BUF, glasgow_config.bitstream_id, BITSTREAM_ID_SIZE);
+    SETUP_EP0_BUF(BITSTREAM_ID_SIZE);
+  } else {
+    if(fpga_start_keep_pipes()) {
+      SETUP_EP0_BUF(0);
       while(EP0CS & _BUSY);
-      xmemcpy(EP0BUF, glasgow_config.bitstream_id, BITSTREAM_ID_SIZE);
-      SETUP_EP0_BUF(BITSTREAM_ID_SIZE);
+      xmemcpy(glasgow_config.bitstream_id, EP0BUF, BITSTREAM_ID_SIZE);
     } else {
-      if(fpga_start()) {
-        SETUP_EP0_BUF(0);
-        while(EP0CS & _BUSY);
-        xmemcpy(glasgow_config.bitstream_id, EP0BUF, BITSTREAM_ID_SIZE);
-      } else {
-        STALL_EP0();
-      }
+      STALL_EP0();
     }
-
-    return;
   }
 
-  // I/O voltage get/set request
-  if((req->bmRequestType == (USB_RECIP_DEVICE|USB_TYPE_VENDOR|USB_DIR_IN) ||
-      req->bmRequestType == (USB_RECIP_DEVICE|USB_TYPE_VENDOR|USB_DIR_OUT)) &&
-     req->bRequest == USB_REQ_IO_VOLT &&
-     req->wLength == 2) {
-    bool     arg_get = (req->bmRequestType & USB_DIR_IN);
-    uint8_t  arg_mask = req->wIndex;
-    pending_setup = false;
+  return true;
+}
 
-    if(arg_get) {
-      while(EP0CS & _BUSY);
-      if(!iobuf_get_voltage(arg_mask, (__xdata uint16_t *)EP0BUF)) {
-        STALL_EP0();
-      } else {
-        SETUP_EP0_BUF(2);
-      }
+// I/O voltage get/set request
+static bool handle_io_volt() {
+  __xdata struct usb_req_setup *req = (__xdata struct usb_req_setup *)SETUPDAT;
+  bool     arg_get = (req->bmRequestType & USB_DIR_IN);
+  uint8_t  arg_mask = req->wIndex;
+  pending_setup = false;
+
+  if(arg_get) {
+    while(EP0CS & _BUSY);
+    if(!iobuf_get_voltage(arg_mask, (__xdata uint16_t *)EP0BUF)) {
+      STALL_EP0();
     } else {
       SETUP_EP0_BUF(2);
-      while(EP0CS & _BUSY);
-      if(!iobuf_set_voltage(arg_mask, (__xdata uint16_t *)EP0BUF)) {
-        latch_status_bit(ST_ERROR);
-      }
     }
+  } else {
+    SETUP_EP0_BUF(2);
+    while(EP0CS & _BUSY);
+    if(!iobuf_set_voltage(arg_mask, (__xdata uint16_t *)EP0BUF)) {
+      latch_status_bit(ST_ERROR);
+    }
+  }
 
-    return;
+  return true;
+}
+
+// Voltage sense request
+static bool handle_sense_volt() {
+  __xdata struct usb_req_setup *req = (__xdata struct usb_req_setup *)SETUPDAT;
+  uint8_t  arg_mask = req->wIndex;
+  pending_setup = false;
+  bool result;
+
+  while(EP0CS & _BUSY);
+
+  if(glasgow_config.revision == GLASGOW_REV_C2)
+    result = iobuf_measure_voltage_ina233(arg_mask, (__xdata uint16_t *)EP0BUF);
+  else
+    result = iobuf_measure_voltage_adc081c(arg_mask, (__xdata uint16_t *)EP0BUF);
+
+  if(!result) {
+    STALL_EP0();
+  } else {
+    SETUP_EP0_BUF(2);
   }
 
-  // Voltage sense request
-  if(req->bmRequestType == (USB_RECIP_DEVICE|USB_TYPE_VENDOR|USB_DIR_IN) &&
-     req->bRequest == USB_REQ_SENSE_VOLT &&
-     req->wLength == 2) {
-    uint8_t  arg_mask = req->wIndex;
-    pending_setup = false;
-    bool result;
+  return true;
+}
 
+// Voltage alert get/set request
+static bool handle_alert_volt() {
+  __xdata struct usb_req_setup *req = (__xdata struct usb_req_setup *)SETUPDAT;
+  bool     arg_get = (req->bmRequestType & USB_DIR_IN);
+  uint8_t  arg_mask = req->wIndex;
+  pending_setup = false;
+  bool result;
+
+  if(arg_get) {
     while(EP0CS & _BUSY);
 
     if(glasgow_config.revision == GLASGOW_REV_C2)
-      result = iobuf_measure_voltage_ina233(arg_mask, (__xdata uint16_t *)EP0BUF);
+      result = iobuf_get_alert_ina233(arg_mask, (__xdata uint16_t *)EP0BUF, (__xdata uint16_t *)EP0BUF + 1);
     else
-      result = iobuf_measure_voltage_adc081c(arg_mask, (__xdata uint16_t *)EP0BUF);
+      result = iobuf_get_alert_adc081c(arg_mask, (__xdata uint16_t *)EP0BUF, (__xdata uint16_t *)EP0BUF + 1);
 
     if(!result) {
       STALL_EP0();
     } else {
-      SETUP_EP0_BUF(2);
+      SETUP_EP0_BUF(4);
     }
+  } else {
+    SETUP_EP0_BUF(4);
+    while(EP0CS & _BUSY);
 
-    return;
+    if(glasgow_config.revision == GLASGOW_REV_C2)
+      // TODO
+      result = true;
+    else
+      result = iobuf_set_alert_adc081c(arg_mask, (__xdata uint16_t *)EP0BUF, (__xdata uint16_t *)EP0BUF + 1);
+
+    if(!result) {
+      latch_status_bit(ST_ERROR);
+    }
   }
 
-  // Voltage alert get/set request
-  if((req->bmRequestType == (USB_RECIP_DEVICE|USB_TYPE_VENDOR|USB_DIR_IN) ||
-      req->bmRequestType == (USB_RECIP_DEVICE|USB_TYPE_VENDOR|USB_DIR_OUT)) &&
-     req->bRequest == USB_REQ_ALERT_VOLT &&
-     req->wLength == 4) {
-    bool     arg_get = (req->bmRequestType & USB_DIR_IN);
-    uint8_t  arg_mask = req->wIndex;
-    pending_setup = false;
-    bool result;
+  return true;
+}
 
-    if(arg_get) {
-      while(EP0CS & _BUSY);
+// Alert poll request
+static bool handle_poll_alert() {
+  pending_setup = false;
 
-      if(glasgow_config.revision == GLASGOW_REV_C2)
-        result = iobuf_get_alert_ina233(arg_mask, (__xdata uint16_t *)EP0BUF, (__xdata uint16_t *)EP0BUF + 1);
-      else
-        result = iobuf_get_alert_adc081c(arg_mask, (__xdata uint16_t *)EP0BUF, (__xdata uint16_t *)EP0BUF + 1);
+  while(EP0CS & _BUSY);
+  iobuf_poll_alert_adc081c(EP0BUF, /*clear=*/true);
+  SETUP_EP0_BUF(1);
 
-      if(!result) {
-        STALL_EP0();
-      } else {
-        SETUP_EP0_BUF(4);
-      }
-    } else {
-      SETUP_EP0_BUF(4);
-      while(EP0CS & _BUSY);
+  reset_status_bit(ST_ALERT);
 
-      if(glasgow_config.revision == GLASGOW_REV_C2)
-        // TODO
-        result = true;
-      else
-        result = iobuf_set_alert_adc081c(arg_mask, (__xdata uint16_t *)EP0BUF, (__xdata uint16_t *)EP0BUF + 1);
+  return true;
+}
 
-      if(!result) {
-        latch_status_bit(ST_ERROR);
-      }
-    }
+// I/O buffer enable request
+static bool handle_iobuf_enable() {
+  __xdata struct usb_req_setup *req = (__xdata struct usb_req_setup *)SETUPDAT;
+  bool arg_enable = req->wValue;
+  pending_setup = false;
 
-    return;
-  }
+  iobuf_enable(arg_enable);
+  ACK_EP0();
 
-  // Alert poll request
-  if((req->bmRequestType == (USB_RECIP_DEVICE|USB_TYPE_VENDOR|USB_DIR_IN)) &&
-     req->bRequest == USB_REQ_POLL_ALERT &&
-     req->wLength == 1) {
-    pending_setup = false;
+  return true;
+}
 
-    while(EP0CS & _BUSY);
-    iobuf_poll_alert_adc081c(EP0BUF, /*clear=*/true);
-    SETUP_EP0_BUF(1);
+// FIFO flag configuration request
+static bool handle_fifo_flags() {
+  __xdata struct usb_req_setup *req = (__xdata struct usb_req_setup *)SETUPDAT;
+  uint8_t  arg_ep    = req->wIndex & 0xff;
+  bool     arg_prog  = req->wIndex & FIFO_FLAG_PROGRAMMABLE;
+  bool     arg_early = req->wIndex & FIFO_FLAG_EARLY;
+  uint16_t arg_level = req->wValue;
 
-    reset_status_bit(ST_ALERT);
+  if(!fifo_set_flag(arg_ep, arg_prog, arg_early, arg_level))
+    return false;
+  pending_setup = false;
 
-    return;
-  }
+  ACK_EP0();
+  return true;
+}
 
-  // I/O buffer enable request
-  if((req->bmRequestType == (USB_RECIP_DEVICE|USB_TYPE_VENDOR|USB_DIR_OUT)) &&
-     req->bRequest == USB_REQ_IOBUF_ENABLE &&
-     req->wLength == 0) {
-    bool arg_enable = req->wValue;
-    pending_setup = false;
+// FIFO flush request
+static bool handle_fifo_flush() {
+  __xdata struct usb_req_setup *req = (__xdata struct usb_req_setup *)SETUPDAT;
+  uint8_t  arg_iface = req->wIndex;
+  uint8_t  arg_dirs  = req->wValue & (FIFO_DIR_OUT|FIFO_DIR_IN);
 
-    iobuf_enable(arg_enable);
-    ACK_EP0();
+  // Unlike Set Interface, this leaves the data toggles alone, so the host can drop stale data
+  // in one direction of an active pipe without reconfiguring it.
+  if(usb_config_value == 0 || arg_iface > 1 || usb_alt_setting[arg_iface] != 1)
+    return false;
+  pending_setup = false;
 
-    return;
-  }
+  fifo_flush(1 << arg_iface, arg_dirs);
+  ACK_EP0();
+  return true;
+}
 
-  // I/O voltage limit get/set request
-  if((req->bmRequestType == (USB_RECIP_DEVICE|USB_TYPE_VENDOR|USB_DIR_IN) ||
-      req->bmRequestType == (USB_RECIP_DEVICE|USB_TYPE_VENDOR|USB_DIR_OUT)) &&
-     req->bRequest == USB_REQ_LIMIT_VOLT &&
-     req->wLength == 2) {
-    bool     arg_get = (req->bmRequestType & USB_DIR_IN);
-    uint8_t  arg_mask = req->wIndex;
-    pending_setup = false;
+// I/O voltage limit get/set request
+static bool handle_limit_volt() {
+  __xdata struct usb_req_setup *req = (__xdata struct usb_req_setup *)SETUPDAT;
+  bool     arg_get = (req->bmRequestType & USB_DIR_IN);
+  uint8_t  arg_mask = req->wIndex;
+  pending_setup = false;
 
-    if(arg_get) {
-      while(EP0CS & _BUSY);
-      if(!iobuf_get_voltage_limit(arg_mask, (__xdata uint16_t *)EP0BUF)) {
-        STALL_EP0();
-      } else {
-        SETUP_EP0_BUF(2);
-      }
+  if(arg_get) {
+    while(EP0CS & _BUSY);
+    if(!iobuf_get_voltage_limit(arg_mask, (__xdata uint16_t *)EP0BUF)) {
+      STALL_EP0();
     } else {
       SETUP_EP0_BUF(2);
-      while(EP0CS & _BUSY);
-      if(!iobuf_set_voltage_limit(arg_mask, (__xdata uint16_t *)EP0BUF)) {
+    }
+  } else {
+    SETUP_EP0_BUF(2);
+    while(EP0CS & _BUSY);
+    if(!iobuf_set_voltage_limit(arg_mask, (__xdata uint16_t *)EP0BUF)) {
+      latch_status_bit(ST_ERROR);
+    } else {
+      if(!eeprom_write(I2C_ADDR_FX2_MEM,
+                       8 + 4 + __builtin_offsetof(struct glasgow_config, voltage_limit),
+                       (__xdata void *)&glasgow_config.voltage_limit,
+                       sizeof(glasgow_config.voltage_limit),
+                       /*double_byte=*/true, /*page_size=*/8, /*timeout=*/255)) {
         latch_status_bit(ST_ERROR);
-      } else {
-        if(!eeprom_write(I2C_ADDR_FX2_MEM,
-                         8 + 4 + __builtin_offsetof(struct glasgow_config, voltage_limit),
-                         (__xdata void *)&glasgow_config.voltage_limit,
-                         sizeof(glasgow_config.voltage_limit),
-                         /*double_byte=*/true, /*page_size=*/8, /*timeout=*/255)) {
-          latch_status_bit(ST_ERROR);
-        }
       }
     }
-
-    return;
   }
 
-  // Pull resistor get/set request
-  if((req->bmRequestType == (USB_RECIP_DEVICE|USB_TYPE_VENDOR|USB_DIR_IN) ||
-      req->bmRequestType == (USB_RECIP_DEVICE|USB_TYPE_VENDOR|USB_DIR_OUT)) &&
-     req->bRequest == USB_REQ_PULL &&
-     req->wLength == 2) {
-    bool     arg_get = (req->bmRequestType & USB_DIR_IN);
-    uint8_t  arg_selector = req->wIndex;
-    pending_setup = false;
+  return true;
+}
 
-    if(arg_get) {
-      while(EP0CS & _BUSY);
-      if(glasgow_config.revision < GLASGOW_REV_C0 ||
-         !iobuf_get_pull(arg_selector,
-                         (__xdata uint8_t *)EP0BUF + 0,
-                         (__xdata uint8_t *)EP0BUF + 1)) {
-        STALL_EP0();
-      } else {
-        SETUP_EP0_BUF(2);
-      }
+// Pull resistor get/set request
+static bool handle_pull() {
+  __xdata struct usb_req_setup *req = (__xdata struct usb_req_setup *)SETUPDAT;
+  bool     arg_get = (req->bmRequestType & USB_DIR_IN);
+  uint8_t  arg_selector = req->wIndex;
+  pending_setup = false;
+
+  if(arg_get) {
+    while(EP0CS & _BUSY);
+    if(glasgow_config.revision < GLASGOW_REV_C0 ||
+       !iobuf_get_pull(arg_selector,
+                       (__xdata uint8_t *)EP0BUF + 0,
+                       (__xdata uint8_t *)EP0BUF + 1)) {
+      STALL_EP0();
     } else {
       SETUP_EP0_BUF(2);
-      while(EP0CS & _BUSY);
-      if(glasgow_config.revision < GLASGOW_REV_C0 ||
-         !iobuf_set_pull(arg_selector,
-                         *((__xdata uint8_t *)EP0BUF + 0),
-                         *((__xdata uint8_t *)EP0BUF + 1))) {
-        latch_status_bit(ST_ERROR);
-      }
     }
-
-    return;
+  } else {
+    SETUP_EP0_BUF(2);
+    while(EP0CS & _BUSY);
+    if(glasgow_config.revision < GLASGOW_REV_C0 ||
+       !iobuf_set_pull(arg_selector,
+                       *((__xdata uint8_t *)EP0BUF + 0),
+                       *((__xdata uint8_t *)EP0BUF + 1))) {
+      latch_status_bit(ST_ERROR);
+    }
   }
 
-  if(req->bmRequestType == (USB_RECIP_DEVICE|USB_TYPE_VENDOR|USB_DIR_IN) &&
-     req->bRequest == USB_REQ_API_LEVEL &&
-     req->wLength == 1) {
-    pending_setup = false;
+  return true;
+}
 
-    while(EP0CS & _BUSY);
-    EP0BUF[0] = CUR_API_LEVEL;
-    SETUP_EP0_BUF(1);
-    return;
+// API level request
+static bool handle_api_level() {
+  pending_setup = false;
+
+  while(EP0CS & _BUSY);
+  EP0BUF[0] = CUR_API_LEVEL;
+  SETUP_EP0_BUF(1);
+  return true;
+}
+
+// Microsoft descriptor requests
+static bool handle_ms_descriptor() {
+  __xdata struct usb_req_setup *req = (__xdata struct usb_req_setup *)SETUPDAT;
+  enum usb_descriptor_microsoft arg_desc = req->wIndex;
+  pending_setup = false;
+
+  switch(arg_desc) {
+    case USB_DESC_MS_EXTENDED_COMPAT_ID:
+      xmemcpy(scratch, (__xdata void *)&usb_ms_ext_compat_id, usb_ms_ext_compat_id.dwLength);
+      SETUP_EP0_IN_DESC(scratch);
+      return true;
   }
 
-  // Microsoft descriptor requests
-  if(req->bmRequestType == (USB_RECIP_DEVICE|USB_TYPE_VENDOR|USB_DIR_IN) &&
-     req->bRequest == USB_REQ_GET_MS_DESCRIPTOR) {
-    enum usb_descriptor_microsoft arg_desc = req->wIndex;
-    pending_setup = false;
+  STALL_EP0();
+  return true;
+}
 
-    switch(arg_desc) {
-      case USB_DESC_MS_EXTENDED_COMPAT_ID:
-        xmemcpy(scratch, (__xdata void *)&usb_ms_ext_compat_id, usb_ms_ext_compat_id.dwLength);
-        SETUP_EP0_IN_DESC(scratch);
-        return;
-    }
+enum {
+  // Setup handler flags
+  SETUP_IN    = 1<<0, // accepts IN requests
+  SETUP_OUT   = 1<<1, // accepts OUT requests
+  SETUP_FPGA  = 1<<2, // left pending, and so NAKed, until a stored bitstream is loaded
+};
 
-    STALL_EP0();
-    return;
+struct setup_handler {
+  bool    (*handle)();
+  uint8_t   flags;
+  uint16_t  min_length;
+  uint16_t  max_length;
+};
+
+#define SETUP_HANDLER(handle_, flags_, min_length_, max_length_) \
+  { .handle = handle_, .flags = flags_, .min_length = min_length_, .max_length = max_length_ }
+
+// Glasgow API requests are dispatched through a table indexed by bRequest, so that the cost of
+// dispatching a request does not depend on how many requests there are. The handlers check
+// the direction and length of the request using the table, and anything else on their own,
+// returning false if the request is invalid.
+__code const struct setup_handler setup_handlers[] = {
+  [USB_REQ_API_LEVEL       - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_api_level,        SETUP_IN,               1, 1),
+  [USB_REQ_EEPROM          - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_eeprom,           SETUP_IN|SETUP_OUT,     0, 0xffff),
+  [USB_REQ_FPGA_CFG        - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_fpga_cfg,         SETUP_OUT,              0, 0xffff),
+  [USB_REQ_STATUS          - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_status,           SETUP_IN,               1, 1),
+  [USB_REQ_REGISTER        - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_register,         SETUP_IN|SETUP_OUT|SETUP_FPGA, 0, 0xffff),
+  [USB_REQ_IO_VOLT         - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_io_volt,          SETUP_IN|SETUP_OUT,     2, 2),
+  [USB_REQ_SENSE_VOLT      - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_sense_volt,       SETUP_IN,               2, 2),
+  [USB_REQ_ALERT_VOLT      - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_alert_volt,       SETUP_IN|SETUP_OUT,     4, 4),
+  [USB_REQ_POLL_ALERT      - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_poll_alert,       SETUP_IN,               1, 1),
+  [USB_REQ_BITSTREAM_ID    - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_bitstream_id,     SETUP_IN|SETUP_OUT|SETUP_FPGA,
+                  BITSTREAM_ID_SIZE, BITSTREAM_ID_SIZE),
+  [USB_REQ_IOBUF_ENABLE    - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_iobuf_enable,     SETUP_OUT,              0, 0),
+  [USB_REQ_LIMIT_VOLT      - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_limit_volt,       SETUP_IN|SETUP_OUT,     2, 2),
+  [USB_REQ_PULL            - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_pull,             SETUP_IN|SETUP_OUT,     2, 2),
+  [USB_REQ_FPGA_CFG_BULK   - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_fpga_cfg_bulk,    SETUP_OUT,              4, 4 + BITSTREAM_ID_SIZE),
+  [USB_REQ_BITSTREAM_SLOT  - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_bitstream_slot,   SETUP_OUT,
+                  BITSTREAM_ID_SIZE, BITSTREAM_ID_SIZE),
+  [USB_REQ_FPGA_TIMING     - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_fpga_timing,      SETUP_IN,
+                  sizeof(fpga_phase_ticks), sizeof(fpga_phase_ticks)),
+  [USB_REQ_EEPROM_BULK     - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_eeprom_bulk,      SETUP_OUT,              4, 4),
+  [USB_REQ_EEPROM_PAGES    - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_eeprom_pages,     SETUP_IN,               2, 2),
+  [USB_REQ_REGISTER_BATCH  - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_register_batch,   SETUP_IN|SETUP_OUT|SETUP_FPGA, 0, 64),
+  [USB_REQ_REGISTER_POLL   - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_register_poll,    SETUP_IN|SETUP_OUT|SETUP_FPGA,
+                  3, sizeof(reg_poll)),
+  [USB_REQ_REGISTER_SHADOW - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_register_shadow,  SETUP_OUT|SETUP_FPGA,   0, REG_SHADOW_COUNT),
+  [USB_REQ_REGISTER_SAMPLE - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_register_sample,  SETUP_IN|SETUP_OUT,     2, 0xffff),
+  [USB_REQ_FIFO_FLAGS      - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_fifo_flags,       SETUP_OUT,              0, 0),
+  [USB_REQ_FIFO_FLUSH      - USB_REQ_API_LEVEL] =
+    SETUP_HANDLER(handle_fifo_flush,       SETUP_OUT,              0, 0),
+};
+
+// Requests defined by others are few and far between, and are dispatched separately.
+__code const struct setup_handler setup_handler_cypress_eeprom =
+  SETUP_HANDLER(handle_eeprom,             SETUP_IN|SETUP_OUT,     0, 0xffff);
+__code const struct setup_handler setup_handler_libfx2_page_size =
+  SETUP_HANDLER(handle_libfx2_page_size,   SETUP_OUT,              0, 0xffff);
+__code const struct setup_handler setup_handler_ms_descriptor =
+  SETUP_HANDLER(handle_ms_descriptor,      SETUP_IN,               0, 0xffff);
+
+void handle_pending_usb_setup() {
+  __xdata struct usb_req_setup *req = (__xdata struct usb_req_setup *)SETUPDAT;
+  __code const struct setup_handler *handler = NULL;
+  uint8_t index = req->bRequest - USB_REQ_API_LEVEL;
+
+  if(index < ARRAYSIZE(setup_handlers)) {
+    handler = &setup_handlers[index];
+  } else switch(req->bRequest) {
+    case USB_REQ_CYPRESS_EEPROM_DB: handler = &setup_handler_cypress_eeprom;   break;
+    case USB_REQ_LIBFX2_PAGE_SIZE:  handler = &setup_handler_libfx2_page_size; break;
+    case USB_REQ_GET_MS_DESCRIPTOR: handler = &setup_handler_ms_descriptor;    break;
+  }
+
+  if(handler &&
+     (req->bmRequestType & ~USB_DIR_IN) == (USB_RECIP_DEVICE|USB_TYPE_VENDOR) &&
+     (handler->flags & ((req->bmRequestType & USB_DIR_IN) ? SETUP_IN : SETUP_OUT)) &&
+     req->wLength >= handler->min_length && req->wLength <= handler->max_length) {
+    if((handler->flags & SETUP_FPGA) && bitstream_load_length > 0)
+      return;
+    if(handler->handle())
+      return;
   }
 
+  pending_setup = false;
   STALL_EP0();
 }
 
@@ -876,60 +1861,37 @@ int main() {
   T2CON = _CPRL2;
   ET2 = true;
 
+  // Use timer 0 for timestamps.
+  timer_init();
+
   // Set up endpoint interrupts for ACT LED.
   EPIE |= _EPI_EP0IN|_EPI_EP0OUT|_EPI_EP2|_EPI_EP4|_EPI_EP6|_EPI_EP8;
 
   // Set up interrupt for ADC ALERT, see documentation at the armed_alert definition for details
   armed_alert = true;
 
-  // If there's a bitstream flashed, load it.
-  if(glasgow_config.bitstream_size > 0) {
-    uint32_t length = glasgow_config.bitstream_size;
-    uint8_t  chip = I2C_ADDR_ICE_MEM;
-    uint16_t addr = 0;
-
-    // Loading the bitstream over I2C can take up to five seconds.
-    IOD |=  (1<<PIND_LED_ACT);
-
-    fpga_reset();
-    while(length > 0) {
-      uint8_t chunk_len = 0x80;
-      if(length < chunk_len)
-        chunk_len = length;
-
-      if(!eeprom_read(chip, addr, (uint8_t *)&scratch, chunk_len, /*double_byte=*/true)) {
-        latch_status_bit(ST_ERROR);
-        break;
-      }
-      fpga_load((__xdata uint8_t *)scratch, chunk_len);
-
-      length -= chunk_len;
-      addr   += chunk_len;
-      if(addr == 0) {
-        // Advance to the next logical chip in case of address wraparound.
-        chip += 1;
-        if(chip == I2C_ADDR_ICE_MEM + 2) {
-          // See explanation in USB_REQ_EEPROM.
-          chip  = I2C_ADDR_FX2_MEM;
-          addr += 0x7000;
-        }
-      }
-    }
-    if(length == 0) {
-      if(!fpga_start())
-        latch_status_bit(ST_ERROR);
-    }
-
-    IOD &= ~(1<<PIND_LED_ACT);
-  }
+  // If there's a bitstream flashed, start loading it. The load is finished in the main loop,
+  // so that the device enumerates, and requests that do not need the FPGA can be served,
+  // right away.
+  if(glasgow_config.bitstream_size > 0)
+    bitstream_load_start(I2C_ADDR_ICE_MEM, 0, glasgow_config.bitstream_size, /*rle=*/false);
 
   // Finally, enumerate.
   usb_init(/*reconnect=*/true);
 
   while(1) {
-    if(pending_setup)
+    if(pending_setup) {
+      // If the host gives up on a register poll and sends another request, stop polling.
+      reg_poll_active = false;
       handle_pending_usb_setup();
+    }
+    if(reg_poll_active)
+      register_poll_step();
     if(!armed_alert)
       handle_pending_alert();
+    if(bitstream_load_length > 0)
+      bitstream_load_step();
+    else
+      fpga_reg_sample_step();
   }
 }
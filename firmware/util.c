@@ -1,7 +1,34 @@
 #include <fx2regs.h>
+#include <fx2ints.h>
 #include <fx2i2c.h>
 #include "glasgow.h"
 
+// Timer 0 counts at CLKOUT/12, that is 4 MHz, and its overflows extend it to 32 bits.
+static volatile uint16_t timer_overflows;
+
+void isr_TF0() __interrupt(_INT_TF0) {
+  timer_overflows++;
+}
+
+void timer_init() {
+  TMOD = (TMOD & 0xf0) | 0x01; // timer 0 in 16-bit mode
+  ET0 = true;
+  TR0 = true;
+}
+
+uint32_t timer_ticks() {
+  uint16_t high;
+  uint8_t  th, tl;
+
+  // Retry if the low byte carries into the high byte, or the timer overflows, while reading it.
+  do {
+    high = timer_overflows;
+    th   = TH0;
+    tl   = TL0;
+  } while(th != TH0 || high != timer_overflows);
+  return ((uint32_t)high << 16) | ((uint16_t)th << 8) | tl;
+}
+
 bool i2c_reg8_read(uint8_t addr, uint8_t reg,
                          __pdata uint8_t *value, uint8_t length) {
   if(!i2c_start(addr<<1))
@@ -35,3 +62,61 @@ fail:
   i2c_stop();
   return false;
 }
+
+// Write `length` bytes at `addr` to a 16-bit addressed EEPROM with 2**`page_size` byte pages,
+// as a part of a sequence of writes to consecutive addresses. A page write is started at the first
+// byte of the sequence (if `first` is set) or of a page, after the EEPROM acknowledges that
+// the previous write cycle is complete. It is ended at the last byte of a page or (if `last`
+// is set) of the sequence. In between, the I2C transaction is left open, so that the caller can
+// fetch more data for the page. The last write cycle is not waited for, so the caller can do
+// something useful in the meantime; eeprom_wait() must be called before the EEPROM is accessed
+// again in another way.
+bool eeprom_write_seq(uint8_t chip, uint16_t addr, __xdata const uint8_t *buf, uint8_t length,
+                      uint8_t page_size, bool first, bool last, uint8_t timeout) {
+  __xdata uint8_t addr_bytes[2];
+  uint16_t page_mask = (1 << page_size) - 1;
+  uint16_t page_len;
+
+  while(length > 0) {
+    if(first || (addr & page_mask) == 0) {
+      if(!eeprom_wait(chip, timeout))
+        return false;
+      addr_bytes[0] = addr >> 8;
+      addr_bytes[1] = addr & 0xff;
+      if(!i2c_start(chip<<1))
+        goto fail;
+      if(!i2c_write(addr_bytes, 2))
+        goto fail;
+      first = false;
+    }
+
+    page_len = page_mask + 1 - (addr & page_mask);
+    if(page_len > length)
+      page_len = length;
+    if(!i2c_write(buf, page_len))
+      goto fail;
+    addr   += page_len;
+    buf    += page_len;
+    length -= page_len;
+
+    if((addr & page_mask) == 0 || (last && length == 0)) {
+      if(!i2c_stop())
+        return false;
+    }
+  }
+  return true;
+
+fail:
+  i2c_stop();
+  return false;
+}
+
+bool eeprom_wait(uint8_t chip, uint8_t timeout) {
+  // The EEPROM does not acknowledge its address until the write cycle completes.
+  do {
+    if(i2c_start(chip<<1))
+      return i2c_stop();
+    i2c_stop();
+  } while(--timeout);
+  return false;
+}
@@ -6,6 +6,9 @@ from ...support.logging import *
 from ...support.chunked_fifo import *
 from ...support.task_queue import *
 from .. import AccessDemultiplexer, AccessDemultiplexerInterface
+from ...device import GlasgowDeviceError
+from ...device.hardware import (CONFIG_REGISTER_TUNNEL, CONFIG_DEEP_IN, CONFIG_DEEP_OUT,
+                                CONFIG_ISOCHRONOUS_IN)
 
 
 # On Linux, the total amount of in-flight USB requests for the entire system is limited
@@ -60,20 +63,52 @@ _xfers_per_queue = min(16, _max_packets_per_ep // _packets_per_xfer)
 
 
 class DirectDemultiplexer(AccessDemultiplexer):
-    def __init__(self, device, pipe_count):
+    def __init__(self, device, pipe_count, *, register_tunnel=False, isochronous_in=False,
+                 pipe_directions=None):
         super().__init__(device)
         self._claimed = set()
 
+        # The register tunnel takes the place of the last pipe, in a configuration of its own.
+        # Otherwise, if pipe Q is only used in one direction (as declared by the FIFOs that
+        # the applets requested), pick a configuration that gives the endpoint buffer memory of
+        # the other direction to pipe P.
+        special_config = None
+        if register_tunnel:
+            pipe_count += 1
+            special_config = CONFIG_REGISTER_TUNNEL
+        elif isochronous_in:
+            special_config = CONFIG_ISOCHRONOUS_IN
+        elif pipe_count == 2 and pipe_directions is not None:
+            q_has_in, q_has_out = pipe_directions[1]
+            if not q_has_in:
+                special_config = CONFIG_DEEP_IN
+            elif not q_has_out:
+                special_config = CONFIG_DEEP_OUT
+        special_configs = (CONFIG_REGISTER_TUNNEL, CONFIG_DEEP_IN, CONFIG_DEEP_OUT,
+                           CONFIG_ISOCHRONOUS_IN)
         for config in device.usb_handle.getDevice().iterConfigurations():
-            if config.getNumInterfaces() == pipe_count:
+            config_value = config.getConfigurationValue()
+            if special_config is not None:
+                matches = config_value == special_config
+            else:
+                matches = (config.getNumInterfaces() == pipe_count and
+                           config_value not in special_configs)
+            if matches:
                 try:
-                    device.usb_handle.setConfiguration(config.getConfigurationValue())
+                    device.usb_handle.setConfiguration(config_value)
                 except (usb1.USBErrorInvalidParam, usb1.USBErrorNotSupported):
                     # Neither WinUSB, nor libusbK, nor libusb0 allow selecting any configuration
                     # that is not the 1st one. This is a limitation of the KMDF USB target.
                     #
                     # Some libusb versions report InvalidParam and some NotSupported.
-                    pass
+                    #
+                    # Falling back to the 1st configuration only works for the default ones.
+                    # The gateware is built for the endpoints of a special configuration (such
+                    # as the packet size of an isochronous EP6IN, or pipe Q being reserved for
+                    # a register tunnel), and would silently corrupt data or stall otherwise.
+                    if special_config is not None:
+                        raise GlasgowDeviceError(
+                            "USB configuration {} cannot be selected".format(config_value))
                 break
         else:
             assert False
@@ -162,18 +197,29 @@ class DirectDemultiplexerInterface(AccessDemultiplexerInterface):
 
         settings = list(interface.iterSettings())
         setting = settings[1] # alt-setting 1 has the actual endpoints
+        self._endpoint_in  = None
+        self._endpoint_out = None
         for endpoint in setting.iterEndpoints():
             address = endpoint.getAddress()
             packet_size = endpoint.getMaxPacketSize()
             if address & usb1.ENDPOINT_DIR_MASK == usb1.ENDPOINT_IN:
                 self._endpoint_in = address
                 self._in_packet_size = packet_size
+                self._in_isochronous = (endpoint.getAttributes() & usb1.TRANSFER_TYPE_MASK ==
+                                        usb1.TRANSFER_TYPE_ISOCHRONOUS)
+                if self._in_isochronous:
+                    # A high-bandwidth endpoint transfers several packets per microframe, which
+                    # libusb treats as a single isochronous packet.
+                    self._in_packet_size = ((packet_size & 0x7ff) *
+                                            (1 + ((packet_size >> 11) & 0b11)))
             if address & usb1.ENDPOINT_DIR_MASK == usb1.ENDPOINT_OUT:
                 self._endpoint_out = address
                 self._out_packet_size = packet_size
-        assert self._endpoint_in != None and self._endpoint_out != None
+        # In some configurations, pipe Q has only one of the endpoints.
+        assert self._endpoint_in != None or self._endpoint_out != None
 
         self._interface  = self.device.usb_handle.claimInterface(self._pipe_num)
+        self._activated  = False
         self._in_tasks   = TaskQueue()
         self._in_buffer  = ChunkedFIFO()
         self._out_tasks  = TaskQueue()
@@ -195,16 +241,22 @@ class DirectDemultiplexerInterface(AccessDemultiplexerInterface):
         await self.device.write_register(self._addr_reset, 1)
 
         self.logger.trace("FIFO: synchronizing buffers")
-        self.device.usb_handle.setInterfaceAltSetting(self._pipe_num, 1)
+        if not self._activated:
+            self.device.usb_handle.setInterfaceAltSetting(self._pipe_num, 1)
+            self._activated = True
+        else:
+            # The interface is already active, so only the stale data needs to be discarded.
+            await self.device.flush_fifo(self._pipe_num)
         self._in_buffer .clear()
         self._out_buffer.clear()
 
         # Pipeline reads before deasserting reset, so that if the applet immediately starts
         # streaming data, there are no overflows. (This is perhaps not the best way to implement
         # an applet, but we can support it easily enough, and it avoids surprise overflows.)
-        self.logger.trace("FIFO: pipelining reads")
-        for _ in range(_xfers_per_queue):
-            self._in_tasks.submit(self._in_task())
+        if self._endpoint_in is not None:
+            self.logger.trace("FIFO: pipelining reads")
+            for _ in range(_xfers_per_queue):
+                self._in_tasks.submit(self._in_task())
         # Give the IN tasks a chance to submit their transfers before deasserting reset.
         await asyncio.sleep(0)
 
@@ -218,13 +270,19 @@ class DirectDemultiplexerInterface(AccessDemultiplexerInterface):
                     self.logger.trace("FIFO: read pushback")
                     await self._in_pushback.wait()
 
-        size = self._in_packet_size * _packets_per_xfer
-        data = await self.device.bulk_read(self._endpoint_in, size)
+        if self._in_isochronous:
+            data = await self.device.iso_read(self._endpoint_in,
+                                              self._in_packet_size, _packets_per_xfer)
+        else:
+            size = self._in_packet_size * _packets_per_xfer
+            data = await self.device.bulk_read(self._endpoint_in, size)
         self._in_buffer.write(data)
 
         self._in_tasks.submit(self._in_task())
 
     async def read(self, length=None, *, flush=True):
+        assert self._endpoint_in is not None
+
         if flush and len(self._out_buffer) > 0:
             # Flush the buffer, so that everything written before the read reaches the device.
             await self.flush(wait=False)
@@ -301,6 +359,8 @@ class DirectDemultiplexerInterface(AccessDemultiplexerInterface):
             self._out_tasks.submit(self._out_task(self._out_slice()))
 
     async def write(self, data):
+        assert self._endpoint_out is not None
+
         if self._write_buffer_size is not None:
             # If write buffer is bounded, and we have more inflight requests than the configured
             # write buffer size, then wait until the inflight requests arrive before continuing.
@@ -343,6 +403,8 @@ class DirectDemultiplexerInterface(AccessDemultiplexerInterface):
 
     async def flush(self, wait=True):
         self.logger.trace("FIFO: flush")
+        if self._endpoint_out is None:
+            return
 
         # First, we ensure we can submit one more task. (There can be more tasks than
         # _xfers_per_queue because a task may spawn another one just before it terminates.)
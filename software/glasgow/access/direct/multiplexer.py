@@ -97,6 +97,7 @@ class DirectMultiplexer(AccessMultiplexer):
         self._claimed_ports = set()
         self._pipes         = pipes
         self._claimed_pipes = 0
+        self._interfaces    = []
         self._analyzer      = None
         self._registers     = registers
         self._fx2_crossbar  = fx2_crossbar
@@ -109,6 +110,10 @@ class DirectMultiplexer(AccessMultiplexer):
     def pipe_count(self):
         return self._claimed_pipes
 
+    @property
+    def pipe_directions(self):
+        return [(iface.has_in_fifo, iface.has_out_fifo) for iface in self._interfaces]
+
     def claim_interface(self, applet, args, with_analyzer=True, throttle="fifo"):
         if self._claimed_pipes == len(self._pipes):
             applet.logger.error("cannot claim pipe: out of pipes")
@@ -152,6 +157,7 @@ class DirectMultiplexer(AccessMultiplexer):
 
         iface = DirectMultiplexerInterface(applet, analyzer, self._registers,
             self._fx2_crossbar, pipe_num, pins, throttle)
+        self._interfaces.append(iface)
         self.submodules += iface
         return iface
 
@@ -168,6 +174,10 @@ class DirectMultiplexerInterface(AccessMultiplexerInterface):
         self._pins         = pins
         self._throttle     = throttle
 
+        # The FIFOs used by the applet determine which USB configuration the pipes will use.
+        self.has_in_fifo   = False
+        self.has_out_fifo  = False
+
         self.reset, self._addr_reset = self._registers.add_rw(1, reset=1)
         self.logger.debug("adding reset register at address %#04x", self._addr_reset)
 
@@ -196,12 +206,14 @@ class DirectMultiplexerInterface(AccessMultiplexerInterface):
         return fifo
 
     def get_in_fifo(self, **kwargs):
+        self.has_in_fifo = True
         fifo = self._fx2_crossbar.get_in_fifo(self._pipe_num, **kwargs, reset=self.reset)
         if self.analyzer:
             self.analyzer.add_in_fifo_event(self.applet, fifo)
         return self._throttle_fifo(_FIFOWritePort(fifo))
 
     def get_out_fifo(self, **kwargs):
+        self.has_out_fifo = True
         fifo = self._fx2_crossbar.get_out_fifo(self._pipe_num, **kwargs, reset=self.reset)
         if self.analyzer:
             self.analyzer.add_out_fifo_event(self.applet, fifo)
@@ -237,6 +237,13 @@ def get_argparser():
         parser.add_argument(
             "--override-required-revision", default=False, action="store_true",
             help="(advanced) override applet revision requirement")
+        g_pipes = parser.add_mutually_exclusive_group()
+        g_pipes.add_argument(
+            "--register-tunnel", default=False, action="store_true",
+            help="(advanced) access FPGA registers through pipe Q instead of I2C")
+        g_pipes.add_argument(
+            "--isochronous", default=False, action="store_true",
+            help="(advanced) read pipe P through an isochronous endpoint with reserved bandwidth")
 
     def add_run_args(parser):
         add_build_args(parser)
@@ -308,6 +315,11 @@ def get_argparser():
         "--remove-bitstream", default=False, action="store_true",
         help="remove any bitstream present")
     add_applet_arg(g_flash_bitstream, mode="build")
+    p_flash.add_argument(
+        "--slot", metavar="INDEX", type=int,
+        choices=range(GlasgowConfig.bitstream_slot_count),
+        help="store the bitstream in slot INDEX, from where it is loaded when an applet "
+             "requires it, instead of loading it at power-up")
 
     p_build = subparsers.add_parser(
         "build", formatter_class=TextHelpFormatter,
@@ -365,7 +377,9 @@ def get_argparser():
 def _applet(revision, args):
     target = GlasgowHardwareTarget(revision=revision,
                                    multiplexer_cls=DirectMultiplexer,
-                                   with_analyzer=hasattr(args, "trace") and args.trace)
+                                   with_analyzer=hasattr(args, "trace") and args.trace,
+                                   with_register_tunnel=args.register_tunnel,
+                                   with_isochronous_in=args.isochronous)
     applet = GlasgowApplet.all_applets[args.applet]()
     try:
         message = ("applet requires device rev{}+, rev{} found"
@@ -515,7 +529,10 @@ async def _main():
 
         if args.action in ("run", "repl", "script"):
             target, applet = _applet(device.revision, args)
-            device.demultiplexer = DirectDemultiplexer(device, target.multiplexer.pipe_count)
+            device.demultiplexer = DirectDemultiplexer(device, target.multiplexer.pipe_count,
+                register_tunnel=args.register_tunnel,
+                isochronous_in=args.isochronous,
+                pipe_directions=target.multiplexer.pipe_directions)
             plan = target.build_plan()
 
             if args.prebuilt or args.bitstream:
@@ -525,6 +542,9 @@ async def _main():
             else:
                 await device.download_target(plan, rebuild=args.rebuild)
 
+            if args.register_tunnel:
+                await device.open_register_tunnel(target.addr_register_tunnel_reset)
+
             do_trace = hasattr(args, "trace") and args.trace
             if do_trace:
                 logger.info("starting applet analyzer")
@@ -668,6 +688,7 @@ async def _main():
                     len(fx2_config.firmware[0][1]) != GlasgowConfig.size):
                 raise SystemExit("Unrecognized or corrupted configuration block")
             glasgow_config = GlasgowConfig.decode(fx2_config.firmware[0][1])
+            old_bitstream_size = glasgow_config.bitstream_size
 
             logger.info("device has serial %s-%s",
                         glasgow_config.revision, glasgow_config.serial)
@@ -680,9 +701,15 @@ async def _main():
                             glasgow_config.bitstream_id.hex())
             else:
                 logger.info("device does not have flashed bitstream")
+            for slot, slot_bitstream_id in (await device.bitstream_slots()).items():
+                logger.info("device has bitstream ID %s in slot %d",
+                            slot_bitstream_id.hex(), slot)
 
             new_bitstream = b""
-            if args.remove_bitstream:
+            if args.remove_bitstream and args.slot is not None:
+                logger.info("removing bitstream from slot %d", args.slot)
+                glasgow_config.bitstream_slots[args.slot] = 0
+            elif args.remove_bitstream:
                 logger.info("removing bitstream")
                 glasgow_config.bitstream_size = 0
                 glasgow_config.bitstream_id   = b"\x00"*16
@@ -691,8 +718,6 @@ async def _main():
                 with args.bitstream as f:
                     new_bitstream_id = f.read(16)
                     new_bitstream    = f.read()
-                    glasgow_config.bitstream_size = len(new_bitstream)
-                    glasgow_config.bitstream_id   = new_bitstream_id
             elif args.applet:
                 logger.info("building bitstream for applet %s", args.applet)
                 target, applet = _applet(device.revision, args)
@@ -706,8 +731,21 @@ async def _main():
                 # storing the bitstream hash (as opposed to Verilog hash) in the ID,
                 # as building the bitstream takes much longer than flashing it.
                 logger.info("built bitstream ID %s", new_bitstream_id.hex())
+
+            if new_bitstream and args.slot is not None:
+                logger.info("programming bitstream into slot %d", args.slot)
+                await device.write_bitstream_slot(glasgow_config, args.slot,
+                                                  new_bitstream, new_bitstream_id)
+                new_bitstream = b""
+            elif new_bitstream:
                 glasgow_config.bitstream_size = len(new_bitstream)
                 glasgow_config.bitstream_id   = new_bitstream_id
+                # Slots that the new bitstream overwrites are no longer valid.
+                regions = await device.bitstream_slot_regions(glasgow_config)
+                for slot, region in regions.items():
+                    if region.start < len(new_bitstream):
+                        logger.warn("bitstream overwrites slot %d, removing it", slot)
+                        glasgow_config.bitstream_slots[slot] = 0
 
             fx2_config.firmware[0] = (0x4000 - GlasgowConfig.size, glasgow_config.encode())
 
@@ -731,11 +769,17 @@ async def _main():
 
             if new_bitstream:
                 logger.info("programming bitstream")
-                old_bitstream = await device.read_eeprom("ice", 0, len(new_bitstream))
-                if old_bitstream != new_bitstream:
-                    for (addr, chunk) in diff_data(old_bitstream, new_bitstream):
-                        await device.write_eeprom("ice", addr, chunk)
+                if old_bitstream_size == 0:
+                    # There is nothing worth comparing against, so write the bitstream while
+                    # downloading it. This also loads the new bitstream to FPGA.
+                    await device.flash_bitstream(new_bitstream, new_bitstream_id)
+                    pages = None
+                else:
+                    # Only rewrite the pages that changed.
+                    pages = await device.write_eeprom("ice", 0, new_bitstream, compare=True)
+                    logger.info("bitstream differs in %d pages", pages)
 
+                if pages != 0:
                     logger.info("verifying bitstream")
                     if await device.read_eeprom("ice", 0, len(new_bitstream)) != new_bitstream:
                         logger.critical("bitstream programming failed")
@@ -28,17 +28,27 @@ class GlasgowConfig:
 
     :ivar int[2] voltage_limit:
         Maximum allowed I/O port voltage, in millivolts.
+
+    :ivar int[4] bitstream_slots:
+        Addresses of additional bitstreams stored in ICE_MEM, or 0 for empty slots.
+        Each address is a multiple of 256, and points to a 16-byte bitstream ID, followed by
+        a 4-byte little-endian bitstream size, followed by the compressed bitstream.
+        These bitstreams are only loaded when requested by the host.
     """
     size = 64
-    _encoding = "<B16sI16s2H"
+    _encoding = "<B16sI16s2H4H"
+
+    bitstream_slot_count = 4
 
     def __init__(self, revision, serial, bitstream_size=0, bitstream_id=b"\x00"*16,
-                 voltage_limit=None):
+                 voltage_limit=None, bitstream_slots=None):
         self.revision = revision
         self.serial   = serial
         self.bitstream_size = bitstream_size
         self.bitstream_id   = bitstream_id
         self.voltage_limit  = [5500, 5500] if voltage_limit is None else voltage_limit
+        self.bitstream_slots = [0] * self.bitstream_slot_count \
+                               if bitstream_slots is None else bitstream_slots
 
     @staticmethod
     def encode_revision(string):
@@ -80,7 +90,8 @@ class GlasgowConfig:
                            self.bitstream_size,
                            self.bitstream_id,
                            self.voltage_limit[0],
-                           self.voltage_limit[1])
+                           self.voltage_limit[1],
+                           *(address >> 8 for address in self.bitstream_slots))
         return data.ljust(self.size, b"\x00")
 
     @classmethod
@@ -96,10 +107,11 @@ class GlasgowConfig:
 
         voltage_limit = [0, 0]
         revision, serial, bitstream_size, bitstream_id, \
-            voltage_limit[0], voltage_limit[1] = \
+            voltage_limit[0], voltage_limit[1], *bitstream_slots = \
             struct.unpack_from(cls._encoding, data, 0)
         return cls(cls.decode_revision(revision),
                    serial.decode("ascii"),
                    bitstream_size,
                    bitstream_id,
-                   voltage_limit)
+                   voltage_limit,
+                   [page << 8 for page in bitstream_slots])
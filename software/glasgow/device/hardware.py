@@ -23,7 +23,7 @@ VID_QIHW         = 0x20b7
 PID_GLASGOW      = 0x9db1
 
 REQ_API_LEVEL    = 0x0F
-CUR_API_LEVEL    = 0x01
+CUR_API_LEVEL    = 0x12
 
 REQ_EEPROM       = 0x10
 REQ_FPGA_CFG     = 0x11
@@ -37,10 +37,49 @@ REQ_BITSTREAM_ID = 0x18
 REQ_IOBUF_ENABLE = 0x19
 REQ_LIMIT_VOLT   = 0x1A
 REQ_PULL         = 0x1B
+REQ_FPGA_CFG_BULK = 0x1C
+REQ_BITSTREAM_SLOT = 0x1D
+REQ_FPGA_TIMING  = 0x1E
+REQ_EEPROM_BULK  = 0x1F
+REQ_EEPROM_PAGES = 0x20
+REQ_REGISTER_BATCH = 0x21
+REQ_REGISTER_POLL = 0x22
+REQ_REGISTER_SHADOW = 0x23
+REQ_REGISTER_SAMPLE = 0x24
+REQ_FIFO_FLAGS   = 0x25
+REQ_FIFO_FLUSH   = 0x26
+
+EEPROM_CMP       = 1<<8
+
+FIFO_FLAG_PROGRAMMABLE = 1<<8
+FIFO_FLAG_EARLY  = 1<<9
+
+FIFO_DIR_OUT     = 1<<0
+FIFO_DIR_IN      = 1<<1
+
+CFG_RLE          = 1<<0
+CFG_FLASH        = 1<<1
 
 ST_ERROR         = 1<<0
 ST_FPGA_RDY      = 1<<1
 ST_ALERT         = 1<<2
+ST_FPGA_CFG      = 1<<3
+
+# Timestamps are counted at CLKOUT/12.
+TIMER_FREQ       = 48e6 / 12
+
+# USB configuration where pipe Q is a register tunnel; the opcodes are those of TunnelRegisters.
+CONFIG_REGISTER_TUNNEL = 3
+TUNNEL_OP_WRITE  = 0x00
+TUNNEL_OP_READ   = 0x01
+TUNNEL_OP_SYNC   = 0x02
+
+# USB configurations where pipe Q has only one direction, and pipe P gets deeper buffering
+# in the other one.
+CONFIG_DEEP_IN   = 4
+CONFIG_DEEP_OUT  = 5
+# USB configuration where pipe P has a high-bandwidth isochronous IN endpoint.
+CONFIG_ISOCHRONOUS_IN = 6
 
 IO_BUF_A         = 1<<0
 IO_BUF_B         = 1<<1
@@ -67,6 +106,10 @@ class GlasgowHardwareDevice:
     def _enumerate_devices(cls, usb_context, _factory_rev=None):
         devices = []
         devices_by_serial = {}
+        # Serials of devices that the built-in firmware was loaded to because of an API level
+        # mismatch. If such a device reports a mismatch again, the built-in firmware is the one
+        # that is out of date, and loading it again would never end.
+        stale_serials = set()
 
         def hotplug_callback(usb_context, device, event):
             if event == usb1.HOTPLUG_EVENT_DEVICE_ARRIVED:
@@ -119,10 +162,17 @@ class GlasgowHardwareDevice:
                         usb1.REQUEST_TYPE_VENDOR, REQ_API_LEVEL, 0, 0, 1)
                 except usb1.USBErrorPipe:
                     device_api_level = 0x00
-                if device_api_level != CUR_API_LEVEL:
+                if device_api_level != CUR_API_LEVEL and device_serial in stale_serials:
+                    handle.close()
+                    logger.error("built-in firmware has API level %d, but the supported "
+                                 "API level is %d; rebuild it with `make -C software`",
+                                 device_api_level, CUR_API_LEVEL)
+                    continue
+                elif device_api_level != CUR_API_LEVEL:
                     logger.info("found rev%s device with API level %d "
                                 "(supported API level is %d)",
                                 revision, device_api_level, CUR_API_LEVEL)
+                    stale_serials.add(device_serial)
                 else:
                     handle.close()
                     logger.debug("found rev%s device with serial %s", revision, device_serial)
@@ -196,24 +246,29 @@ class GlasgowHardwareDevice:
         self.usb_poller = _PollerThread(self.usb_context)
         self.usb_poller.start()
         self.usb_handle = usb_device.open()
+        self._sample_regs = []
+        self._register_tunnel = False
+        self._register_tunnel_claimed = False
+        self._bitstream_slots = None
         try:
             self.usb_handle.setAutoDetachKernelDriver(True)
         except usb1.USBErrorNotSupported:
             pass
 
     def close(self):
+        self._close_register_tunnel()
         self.usb_poller.done = True
         self.usb_handle.close()
         self.usb_context.close()
 
-    async def _do_transfer(self, is_read, setup):
+    async def _do_transfer(self, is_read, setup, iso_packets=0):
         # libusb transfer cancellation is asynchronous, and moreover, it is necessary to wait for
         # all transfers to finish cancelling before closing the event loop. To do this, use
         # separate futures for result and cancel.
         cancel_future = asyncio.Future()
         result_future = asyncio.Future()
 
-        transfer = self.usb_handle.getTransfer()
+        transfer = self.usb_handle.getTransfer(iso_packets=iso_packets)
         setup(transfer)
 
         def usb_callback(transfer):
@@ -229,6 +284,8 @@ class GlasgowHardwareDevice:
                     transfer_type = "CONTROL"
                 if usb_transfer_type == usb1.TRANSFER_TYPE_BULK:
                     transfer_type = "BULK"
+                if usb_transfer_type == usb1.TRANSFER_TYPE_ISOCHRONOUS:
+                    transfer_type = "ISO"
                 endpoint = transfer.getEndpoint()
                 if endpoint & usb1.ENDPOINT_DIR_MASK == usb1.ENDPOINT_IN:
                     endpoint_dir = "IN"
@@ -240,7 +297,13 @@ class GlasgowHardwareDevice:
             elif result_future.cancelled():
                 pass
             elif status == usb1.TRANSFER_COMPLETED:
-                if is_read:
+                if is_read and iso_packets > 0:
+                    # Isochronous packets that were lost are not retried, and their data is
+                    # simply missing from the result.
+                    result_future.set_result(b"".join(buffer
+                        for status, buffer in transfer.iterISO()
+                        if status == usb1.TRANSFER_COMPLETED))
+                elif is_read:
                     result_future.set_result(transfer.getBuffer()[:transfer.getActualLength()])
                 else:
                     result_future.set_result(None)
@@ -291,6 +354,15 @@ class GlasgowHardwareDevice:
         logger.trace("USB: BULK EP%d IN data=<%s> (completed)", endpoint & 0x7f, dump_hex(data))
         return data
 
+    async def iso_read(self, endpoint, packet_size, packet_count):
+        logger.trace("USB: ISO EP%d IN length=%d (submit)",
+                     endpoint & 0x7f, packet_size * packet_count)
+        data = await self._do_transfer(is_read=True, iso_packets=packet_count,
+            setup=lambda transfer:
+                transfer.setIsochronous(endpoint|usb1.ENDPOINT_IN, packet_size * packet_count))
+        logger.trace("USB: ISO EP%d IN data=<%s> (completed)", endpoint & 0x7f, dump_hex(data))
+        return data
+
     async def bulk_write(self, endpoint, data):
         if not isinstance(data, (bytes, bytearray)):
             data = bytes(data)
@@ -304,6 +376,11 @@ class GlasgowHardwareDevice:
         Read ``length`` bytes at ``addr`` from EEPROM at index ``idx``
         in ``chunk_size`` byte chunks.
         """
+        # EP6IN is isochronous in CONFIG_ISOCHRONOUS_IN, and cannot be used for bulk reads.
+        configuration = self.usb_handle.getConfiguration()
+        if idx < 3 and length >= 512 and configuration not in (0, CONFIG_ISOCHRONOUS_IN):
+            return await self._read_eeprom_bulk(idx, addr, length)
+
         data = bytearray()
         while length > 0:
             chunk_length = min(length, chunk_size)
@@ -315,19 +392,45 @@ class GlasgowHardwareDevice:
             length -= chunk_length
         return data
 
-    async def _write_eeprom_raw(self, idx, addr, data, chunk_size=0x1000):
+    async def _read_eeprom_bulk(self, idx, addr, length):
+        # The firmware streams the data into EP6IN with a single sequential read, which is much
+        # faster than reading it in 64-byte slices through EP0. EP6IN only exists in alt-setting 1
+        # of interface 0, so activate it for the duration of the read.
+        logger.debug("reading EEPROM chip %d range %04x-%04x in bulk",
+                     idx, addr, addr + length - 1)
+        with self.usb_handle.claimInterface(0):
+            self.usb_handle.setInterfaceAltSetting(0, 1)
+            await self.control_write(usb1.REQUEST_TYPE_VENDOR, REQ_EEPROM_BULK,
+                                     addr, idx, struct.pack("<L", length))
+            data = await self.bulk_read(6, length)
+        if len(data) != length or await self._status() & ST_ERROR:
+            raise GlasgowDeviceError("reading EEPROM chip {} failed".format(idx))
+        return data
+
+    async def _write_eeprom_raw(self, idx, addr, data, chunk_size=0x1000, compare=False):
         """
         Write ``data`` to ``addr`` in EEPROM at index ``idx``
         in ``chunk_size`` byte chunks.
+
+        If ``compare`` is true, only pages that differ are written, and the number of pages
+        written is returned.
         """
+        pages = 0
         while len(data) > 0:
             chunk_length = min(len(data), chunk_size)
             logger.debug("writing EEPROM chip %d range %04x-%04x",
                          idx, addr, addr + chunk_length - 1)
             await self.control_write(usb1.REQUEST_TYPE_VENDOR, REQ_EEPROM,
-                                     addr, idx, data[:chunk_length])
+                                     addr, idx | (EEPROM_CMP if compare else 0),
+                                     data[:chunk_length])
+            if compare:
+                result = await self.control_read(usb1.REQUEST_TYPE_VENDOR, REQ_EEPROM_PAGES,
+                                                 0, 0, 2)
+                pages += struct.unpack("<H", result)[0]
             addr += chunk_length
             data  = data[chunk_length:]
+        if compare:
+            return pages
 
     @staticmethod
     def _adjust_eeprom_addr_for_kind(kind, addr):
@@ -356,20 +459,29 @@ class GlasgowHardwareDevice:
             length -= chunk_length
         return result
 
-    async def write_eeprom(self, kind, addr, data):
+    async def write_eeprom(self, kind, addr, data, *, compare=False):
         """
         Write ``data`` to ``addr`` in EEPROM of kind ``kind``
         in ``chunk_size`` byte chunks. Valid ``kind`` is ``"fx2"`` or ``"ice"``.
+
+        If ``compare`` is true, the firmware reads back each page first, and only writes
+        the pages that differ. Returns the number of pages written.
         """
         logger.debug("writing %s EEPROM range %04x-%04x",
                      kind, addr, addr + len(data) - 1)
         addr = self._adjust_eeprom_addr_for_kind(kind, addr)
+        # The write may change the slot table or the slots themselves.
+        self._bitstream_slots = None
+        pages = 0
         while len(data) > 0:
             chunk_addr   = addr & ((1 << 16) - 1)
             chunk_length = min(chunk_addr + len(data), 1 << 16) - chunk_addr
-            await self._write_eeprom_raw(addr >> 16, chunk_addr, data[:chunk_length])
+            pages += await self._write_eeprom_raw(addr >> 16, chunk_addr, data[:chunk_length],
+                                                  compare=compare) or 0
             addr += chunk_length
             data  = data[chunk_length:]
+        if compare:
+            return pages
 
     async def _status(self):
         result = await self.control_read(usb1.REQUEST_TYPE_VENDOR, REQ_STATUS, 0, 0, 1)
@@ -379,7 +491,9 @@ class GlasgowHardwareDevice:
         """
         Query device status.
 
-        Returns a set of flags out of ``{"fpga-ready", "alert"}``.
+        Returns a set of flags out of ``{"fpga-ready", "fpga-configuring", "alert"}``.
+        The ``"fpga-configuring"`` flag is set while the device is loading the bitstream flashed
+        to ICE_MEM; requests that access the FPGA are delayed until it finishes.
         """
         status_word = await self._status()
         status_set  = set()
@@ -387,6 +501,8 @@ class GlasgowHardwareDevice:
         # so we ignore it here.
         if status_word & ST_FPGA_RDY:
             status_set.add("fpga-ready")
+        if status_word & ST_FPGA_CFG:
+            status_set.add("fpga-configuring")
         if status_word & ST_ALERT:
             status_set.add("alert")
         return status_set
@@ -402,15 +518,112 @@ class GlasgowHardwareDevice:
             return None
         return bytes(bitstream_id)
 
+    async def fpga_timing(self):
+        """
+        Get the duration of each phase of the last FPGA configuration, in seconds.
+
+        Returns a dict with keys ``"reset"``, ``"load"`` and ``"start"``. The ``"load"`` phase
+        includes the time spent receiving the bitstream over USB or reading it from EEPROM,
+        since it is shifted into the FPGA as it arrives.
+        """
+        ticks = struct.unpack("<3L", await self.control_read(usb1.REQUEST_TYPE_VENDOR,
+                                                             REQ_FPGA_TIMING, 0, 0, 12))
+        return {phase: phase_ticks / TIMER_FREQ
+                for phase, phase_ticks in zip(("reset", "load", "start"), ticks)}
+
+    async def _log_fpga_timing(self):
+        timing = await self.fpga_timing()
+        logger.debug("FPGA configuration took %s",
+                     ", ".join("{} {:.1f} ms".format(phase, duration * 1000)
+                               for phase, duration in timing.items()))
+
+    @staticmethod
+    def _compress_bitstream(bitstream):
+        """
+        Compress ``bitstream`` with the run-length encoding expanded by the firmware.
+
+        The compressed bitstream is a sequence of runs. A header byte ``0x00``-``0x7f`` is
+        followed by 1 to 128 literal bytes, and a header byte ``0x80``-``0xff`` stands for
+        1 to 128 zero bytes.
+        """
+        data = bytearray()
+        def add_literal(chunk):
+            for offset in range(0, len(chunk), 128):
+                run = chunk[offset:offset + 128]
+                data.append(len(run) - 1)
+                data.extend(run)
+
+        offset = 0
+        # A single zero byte is cheaper to keep in a literal run.
+        for match in re.finditer(rb"\x00{2,}", bitstream):
+            add_literal(bitstream[offset:match.start()])
+            length = match.end() - match.start()
+            while length > 0:
+                run_length = min(length, 128)
+                data.append(0x80 | (run_length - 1))
+                length -= run_length
+            offset = match.end()
+        add_literal(bitstream[offset:])
+        return data
+
+    async def _download_bitstream_bulk(self, bitstream, flags, header=b""):
+        # The firmware takes EP2OUT off the FIFO bus while the FPGA is in reset, and shifts
+        # the bitstream out of full 512-byte packets. EP2OUT only exists in alt-setting 1 of
+        # interface 0, so activate it for the duration of the download.
+        with self.usb_handle.claimInterface(0):
+            self.usb_handle.setInterfaceAltSetting(0, 1)
+            await self.control_write(usb1.REQUEST_TYPE_VENDOR, REQ_FPGA_CFG_BULK,
+                                     flags, 0, struct.pack("<L", len(bitstream)) + header)
+            await self.bulk_write(2, bitstream)
+
     async def download_bitstream(self, bitstream, bitstream_id=b"\xff" * 16):
         """Download ``bitstream`` with ID ``bitstream_id`` to FPGA."""
-        # Send consecutive chunks of bitstream.
-        # Sending 0th chunk resets the FPGA.
-        index = 0
-        while index * 1024 < len(bitstream):
-            await self.control_write(usb1.REQUEST_TYPE_VENDOR, REQ_FPGA_CFG,
-                                     0, index, bitstream[index * 1024:(index + 1) * 1024])
-            index += 1
+        # iCE40 bitstreams are mostly zeroes, so they are sent compressed, and expanded by
+        # the firmware as they are being shifted into the FPGA.
+        compressed = self._compress_bitstream(bitstream)
+        logger.debug("compressed bitstream from %d to %d bytes", len(bitstream), len(compressed))
+        if self.usb_handle.getConfiguration() != 0:
+            # Stream the bitstream through the bulk endpoint.
+            # Sending the request resets the FPGA.
+            await self._download_bitstream_bulk(compressed, CFG_RLE)
+        else:
+            # Send consecutive chunks of bitstream through the control endpoint.
+            # Sending 0th chunk resets the FPGA.
+            index = 0
+            while index * 1024 < len(compressed):
+                await self.control_write(usb1.REQUEST_TYPE_VENDOR, REQ_FPGA_CFG, CFG_RLE,
+                                         index, compressed[index * 1024:(index + 1) * 1024])
+                index += 1
+        await self._start_bitstream(bitstream_id)
+
+    async def flash_bitstream(self, bitstream, bitstream_id):
+        """
+        Download ``bitstream`` with ID ``bitstream_id`` to FPGA, and write it to ICE_MEM
+        as it is being downloaded, so that it is loaded at power-up.
+
+        The bitstream size and ID in the configuration block are updated by the firmware.
+        The bitstream is sent to EP2OUT, which exists in every configuration; if the device is
+        not configured yet, it is put into configuration 1 for the duration of the download.
+        Any other configuration is left as it is.
+        """
+        configuration = self.usb_handle.getConfiguration()
+        if configuration == 0:
+            self.usb_handle.setConfiguration(1)
+        try:
+            # The flashed bitstream is loaded from ICE_MEM uncompressed, so it is sent that way.
+            self._bitstream_slots = None
+            await self._download_bitstream_bulk(bitstream, CFG_FLASH, bitstream_id)
+        finally:
+            if configuration == 0:
+                # Return the device to the unconfigured state it was found in.
+                self.usb_handle.setConfiguration(-1)
+        if await self._status() & ST_ERROR:
+            raise GlasgowDeviceError("bitstream programming failed")
+        await self._start_bitstream(bitstream_id)
+
+    async def _start_bitstream(self, bitstream_id):
+        # A new bitstream starts with the register tunnel (if any) in reset.
+        self._close_register_tunnel()
         # Complete configuration by setting bitstream ID.
         # This starts the FPGA.
         try:
@@ -418,11 +631,115 @@ class GlasgowHardwareDevice:
                                      0, 0, bitstream_id)
         except usb1.USBErrorPipe:
             raise GlasgowDeviceError("FPGA configuration failed")
+        await self._log_fpga_timing()
+
+    async def _read_config(self):
+        return GlasgowConfig.decode(await self.read_eeprom("fx2", 8 + 4, GlasgowConfig.size))
+
+    async def bitstream_slot_regions(self, config):
+        """
+        Get the ICE_MEM address ranges occupied by bitstream slots in ``config``.
+
+        Returns a dict mapping slot index to a ``range`` of addresses.
+        """
+        regions = {}
+        for slot, address in enumerate(config.bitstream_slots):
+            if address != 0:
+                _, size = struct.unpack("<16sL", await self.read_eeprom("ice", address, 20))
+                regions[slot] = range(address, address + 20 + size)
+        return regions
+
+    async def bitstream_slots(self):
+        """
+        Get the directory of bitstreams stored in ICE_MEM slots.
+
+        Returns a dict mapping slot index to bitstream ID. The directory is read from
+        the EEPROMs once, and cached until they are written through this device.
+        """
+        if self._bitstream_slots is None:
+            try:
+                config = await self._read_config()
+            except ValueError:
+                return {}
+            slots = {}
+            for slot, address in enumerate(config.bitstream_slots):
+                if address != 0:
+                    slots[slot] = bytes(await self.read_eeprom("ice", address, 16))
+            self._bitstream_slots = slots
+        return dict(self._bitstream_slots)
+
+    async def write_bitstream_slot(self, config, slot, bitstream, bitstream_id):
+        """
+        Store ``bitstream`` with ID ``bitstream_id`` in ICE_MEM slot ``slot``, and point
+        the slot in ``config`` to it. The caller must write ``config`` back to FX2_MEM.
+
+        Slots are allocated from the top of ICE_MEM down, so that they do not overlap
+        the bitstream loaded at power-up, which is stored at the bottom. That bitstream
+        is stored uncompressed, and is larger than ICE_MEM for an HX8K, so slots are only
+        available when there is no power-up bitstream or it is for a smaller device.
+        """
+        compressed = self._compress_bitstream(bitstream)
+        data = struct.pack("<16sL", bitstream_id, len(compressed)) + compressed
+
+        regions = await self.bitstream_slot_regions(config)
+        regions.pop(slot, None)
+        used = list(regions.values())
+        if config.bitstream_size:
+            used.append(range(0, config.bitstream_size))
+
+        # Find the highest page-aligned address where the slot fits. Page 0 is never used,
+        # since it denotes an empty slot.
+        start = (0x20000 - len(data)) & ~0xff
+        while start > 0:
+            overlapping = [region for region in used
+                           if start < region.stop and region.start < start + len(data)]
+            if not overlapping:
+                break
+            start = (min(region.start for region in overlapping) - len(data)) & ~0xff
+        else:
+            if config.bitstream_size:
+                raise GlasgowDeviceError(
+                    "not enough space in ICE_MEM for bitstream slot {}; the bitstream loaded "
+                    "at power-up occupies {} of {} bytes"
+                    .format(slot, config.bitstream_size, 0x20000))
+            raise GlasgowDeviceError("not enough space in ICE_MEM for bitstream slot {}"
+                                     .format(slot))
+
+        logger.debug("writing bitstream slot %d at ICE_MEM %05x", slot, start)
+        await self.write_eeprom("ice", start, data)
+        config.bitstream_slots[slot] = start
+
+    async def load_bitstream_slot(self, slot, bitstream_id):
+        """
+        Load the bitstream with ID ``bitstream_id`` stored in ICE_MEM slot ``slot`` to FPGA.
+        """
+        self._close_register_tunnel()
+        # Clear any error latched by an earlier request, so that ST_ERROR below can only
+        # come from the slot header check.
+        await self._status()
+        await self.control_write(usb1.REQUEST_TYPE_VENDOR, REQ_BITSTREAM_SLOT,
+                                 0, slot, bitstream_id)
+        if await self._status() & ST_ERROR:
+            raise GlasgowDeviceError("bitstream slot {} does not contain bitstream ID {}"
+                                     .format(slot, bitstream_id.hex()))
+        # The bitstream ID can only be read once the bitstream is loaded, and is cleared if
+        # the configuration fails.
+        if await self.bitstream_id() != bitstream_id:
+            raise GlasgowDeviceError("FPGA configuration failed")
+        await self._log_fpga_timing()
 
     async def download_target(self, plan, *, rebuild=False):
         if await self.bitstream_id() == plan.bitstream_id and not rebuild:
             logger.info("device already has bitstream ID %s", plan.bitstream_id.hex())
+            await self._log_fpga_timing()
             return
+        if not rebuild:
+            for slot, slot_bitstream_id in (await self.bitstream_slots()).items():
+                if slot_bitstream_id == plan.bitstream_id:
+                    logger.info("loading bitstream ID %s from slot %d",
+                                plan.bitstream_id.hex(), slot)
+                    await self.load_bitstream_slot(slot, plan.bitstream_id)
+                    return
         logger.info("building bitstream ID %s", plan.bitstream_id.hex())
         await self.download_bitstream(plan.execute(), plan.bitstream_id)
 
@@ -588,14 +905,126 @@ class GlasgowHardwareDevice:
                                          "low={} high={}"
                                          .format(spec or "(none)", low or "{}", high or "{}"))
 
+    async def set_fifo_flag(self, endpoint, *, level=None, early=False):
+        """
+        Configure the FX2 flag pin of ``endpoint`` (one of 2, 4, 6, 8, for FLAGA to FLAGD).
+
+        If ``level`` is ``None``, the pin carries the ~EF (OUT) or ~FF (IN) flag, which is what
+        the stock FX2 crossbar expects. Otherwise, it carries the programmable flag, and ``level``
+        is the value of EPxFIFOPFH:EPxFIFOPFL, encoded as described in the FX2 TRM. If ``early``
+        is true, the flag is asserted one byte early (INFM1 for IN endpoints, OEP1 for OUT
+        endpoints).
+
+        This only makes sense for gateware built to use these flags, and should be done while
+        the FIFOs are held in reset. Flags return to their defaults when the FPGA is reset.
+        """
+        assert endpoint in (2, 4, 6, 8)
+        index = endpoint
+        if level is not None:
+            index |= FIFO_FLAG_PROGRAMMABLE
+        else:
+            level  = 0
+        if early:
+            index |= FIFO_FLAG_EARLY
+        await self.control_write(usb1.REQUEST_TYPE_VENDOR, REQ_FIFO_FLAGS, level, index, [])
+
+    async def flush_fifo(self, interface, *, flush_in=True, flush_out=True):
+        """
+        Discard the data in the FX2 FIFOs of an active ``interface``, in the IN direction,
+        the OUT direction, or both. Unlike selecting the alternate setting again, this leaves
+        the data toggles alone, and takes a single control request.
+        """
+        directions = (FIFO_DIR_IN if flush_in else 0) | (FIFO_DIR_OUT if flush_out else 0)
+        await self.control_write(usb1.REQUEST_TYPE_VENDOR, REQ_FIFO_FLUSH,
+                                 directions, interface, [])
+
     async def _register_error(self, addr):
         if await self._status() & ST_FPGA_RDY:
             raise GlasgowDeviceError("register 0x{:02x} does not exist".format(addr))
         else:
             raise GlasgowDeviceError("FPGA is not configured")
 
+    async def open_register_tunnel(self, addr_reset):
+        """
+        Access FPGA registers through pipe Q instead of I2C from now on, until the FPGA is
+        reconfigured. The bitstream must have been built with a register tunnel whose reset
+        register is at ``addr_reset``, and the USB configuration must reserve pipe Q for it.
+
+        Register writes through the tunnel are not posted; each access waits until the gateware
+        has executed it. Unlike with I2C, accessing a register that does not exist is not
+        detected.
+        """
+        if self.usb_handle.getConfiguration() != CONFIG_REGISTER_TUNNEL:
+            raise GlasgowDeviceError("USB configuration does not include a register tunnel")
+        self._close_register_tunnel()
+        await self.write_register(addr_reset, 1)
+        self.usb_handle.claimInterface(1)
+        self._register_tunnel_claimed = True
+        self.usb_handle.setInterfaceAltSetting(1, 1)
+        await self.write_register(addr_reset, 0)
+        self._register_tunnel = True
+        logger.debug("opened register tunnel")
+
+    def _close_register_tunnel(self):
+        # Go back to accessing the registers through I2C, and release pipe Q.
+        self._register_tunnel = False
+        if self._register_tunnel_claimed:
+            self.usb_handle.releaseInterface(1)
+            self._register_tunnel_claimed = False
+
+    async def _tunnel_registers(self, ops):
+        request = bytearray()
+        response_length = 0
+        for op in ops:
+            if len(op) == 2:
+                addr, width = op
+                request += bytes([TUNNEL_OP_READ, addr, width])
+                response_length += width
+            else:
+                addr, width, value = op
+                request += bytes([TUNNEL_OP_WRITE, addr, width])
+                request += value.to_bytes(width, byteorder="big")
+        # Wait until every command has been executed.
+        request += bytes([TUNNEL_OP_SYNC, 0, 0])
+        response_length += 1
+        await self.bulk_write(4, request)
+
+        # If the gateware does not answer (e.g. because it has no register tunnel, or was
+        # reset), the read would never complete.
+        async def read_response():
+            response = bytearray()
+            while len(response) < response_length:
+                response += await self.bulk_read(8, 512)
+            return response
+        try:
+            response = await asyncio.wait_for(read_response(), timeout=1)
+        except asyncio.TimeoutError:
+            raise GlasgowDeviceError("register tunnel did not respond")
+
+        results = []
+        offset  = 0
+        for op in ops:
+            if len(op) == 2:
+                addr, width = op
+                value = int.from_bytes(response[offset:offset + width], byteorder="little")
+                logger.trace("register %d read: %#04x", addr, value)
+                results.append(value)
+                offset += width
+            else:
+                addr, width, value = op
+                logger.trace("register %d write: %#04x", addr, value)
+                results.append(None)
+        return results
+
     async def read_register(self, addr, width=1):
-        """Read ``width``-byte FPGA register at ``addr``."""
+        """
+        Read ``width``-byte FPGA register at ``addr``.
+
+        Registers wider than 64 bytes are read with a single transfer as well.
+        """
+        if self._register_tunnel and width < 256:
+            value, = await self._tunnel_registers([(addr, width)])
+            return value
         try:
             value = await self.control_read(usb1.REQUEST_TYPE_VENDOR, REQ_REGISTER, addr, 0, width)
             value = int.from_bytes(value, byteorder="little")
@@ -605,10 +1034,366 @@ class GlasgowHardwareDevice:
             await self._register_error(addr)
 
     async def write_register(self, addr, value, width=1):
-        """Write ``value`` to ``width``-byte FPGA register at ``addr``."""
+        """
+        Write ``value`` to ``width``-byte FPGA register at ``addr``.
+
+        Registers wider than 64 bytes are written with a single transfer as well.
+        """
+        if self._register_tunnel and width < 256:
+            await self._tunnel_registers([(addr, width, value)])
+            return
         try:
             logger.trace("register %d write: %#04x", addr, value)
             value = value.to_bytes(width, byteorder="big")
             await self.control_write(usb1.REQUEST_TYPE_VENDOR, REQ_REGISTER, addr, 0, value)
         except usb1.USBErrorPipe:
             await self._register_error(addr)
+
+    async def poll_register(self, addr, mask, value, *, interval=0, timeout=1):
+        """
+        Read the 1-byte FPGA register at ``addr`` every ``interval`` seconds until its value
+        masked with ``mask`` equals ``value``, or ``timeout`` seconds pass.
+
+        The register is polled by the firmware, so no USB round trips are made while waiting.
+        Returns a tuple of the last value read and the number of reads. If the firmware does not
+        answer within ``timeout`` plus ``interval`` plus one second, the poll is abandoned and
+        :class:`GlasgowDeviceError` is raised.
+        """
+        interval_us = round(interval * 1e6)
+        timeout_ms  = round(timeout  * 1e3)
+        if interval_us not in range(1 << 16) or timeout_ms not in range(1 << 16):
+            raise ValueError("register poll interval or timeout out of range")
+        await self.control_write(usb1.REQUEST_TYPE_VENDOR, REQ_REGISTER_POLL, 0, 0,
+                                 struct.pack("<BBBHH", addr, mask, value,
+                                             interval_us, timeout_ms))
+        try:
+            # The firmware checks the timeout only after each read, which may come up to
+            # an interval later.
+            response = await asyncio.wait_for(
+                self.control_read(usb1.REQUEST_TYPE_VENDOR, REQ_REGISTER_POLL, 0, 0, 3),
+                timeout=timeout_ms / 1e3 + interval_us / 1e6 + 1)
+        except usb1.USBErrorPipe:
+            await self._register_error(addr)
+        except asyncio.TimeoutError:
+            raise GlasgowDeviceError("register 0x{:02x} poll did not complete".format(addr))
+        result, iterations = struct.unpack("<BH", response)
+        logger.trace("register %d polled %d times: %#04x", addr, iterations, result)
+        return result, iterations
+
+    async def shadow_registers(self, addrs):
+        """
+        Declare the FPGA registers at ``addrs`` as written only by the host, so that the firmware
+        answers reads of these registers from the last value written or read instead of
+        accessing the FPGA. Only read-write registers up to 32 bits wide whose width is
+        a multiple of 8 should be declared. At most 16 registers can be declared; each call
+        replaces the previous declaration, and reconfiguring the FPGA clears it.
+        """
+        addrs = bytes(addrs)
+        if len(addrs) > 16:
+            raise ValueError("cannot shadow more than 16 registers")
+        logger.trace("register shadow: %s", ", ".join(str(addr) for addr in addrs))
+        await self.control_write(usb1.REQUEST_TYPE_VENDOR, REQ_REGISTER_SHADOW, 0, 0, addrs)
+
+    async def sample_registers(self, regs, period):
+        """
+        Start reading the FPGA registers described by ``regs``, a list of ``(addr, width)``
+        tuples, every ``period`` seconds, and storing the values in a ring buffer on the device.
+        Up to 8 registers, each up to 4 bytes wide, can be sampled. An empty ``regs`` stops
+        sampling. Any samples that were not read yet are discarded.
+
+        Sampling is done by the firmware, so the period does not depend on USB round trips.
+        It stops if the FPGA is reconfigured or a register read fails. The ring buffer holds
+        128 bytes, and each sample takes 4 bytes plus the widths of the registers, so it must
+        be read often enough to not overflow.
+        """
+        regs = list(regs)
+        period_ticks = round(period * TIMER_FREQ)
+        if len(regs) > 8 or any(width not in range(1, 5) for addr, width in regs):
+            raise ValueError("cannot sample registers {}".format(regs))
+        if regs and period_ticks not in range(1, 1 << 32):
+            raise ValueError("register sample period {} s out of range".format(period))
+        request = struct.pack("<I", period_ticks)
+        for addr, width in regs:
+            request += struct.pack("BB", addr, width)
+        logger.trace("register sample: %s every %.6f s",
+                     ", ".join("{}:{}".format(*reg) for reg in regs), period)
+        await self.control_write(usb1.REQUEST_TYPE_VENDOR, REQ_REGISTER_SAMPLE, 0, 0, request)
+        if await self._status() & ST_ERROR:
+            raise GlasgowDeviceError("cannot sample registers {}".format(regs))
+        self._sample_regs = regs
+
+    async def read_register_samples(self):
+        """
+        Read the register samples taken since the last call.
+
+        Returns a tuple of the number of samples dropped because the ring buffer was full, and
+        a list of ``(timestamp, values)`` tuples, where ``timestamp`` is the time in seconds
+        the sample was taken at (it wraps around after approximately 1074 seconds), and
+        ``values`` is a list of register values in the order passed to ``sample_registers``.
+        """
+        widths = [width for addr, width in self._sample_regs]
+        record_len = 4 + sum(widths)
+        # The ring buffer is smaller than 512 bytes, and the firmware only returns whole samples.
+        response = await self.control_read(usb1.REQUEST_TYPE_VENDOR, REQ_REGISTER_SAMPLE,
+                                           0, 0, 2 + 512)
+        overflows, = struct.unpack_from("<H", response)
+        samples = []
+        for offset in range(2, len(response), record_len):
+            timestamp, = struct.unpack_from("<I", response, offset)
+            offset += 4
+            values = []
+            for width in widths:
+                values.append(int.from_bytes(response[offset:offset + width],
+                                             byteorder="little"))
+                offset += width
+            samples.append((timestamp / TIMER_FREQ, values))
+        logger.trace("register samples: %d read, %d dropped", len(samples), overflows)
+        return overflows, samples
+
+    async def _register_batch(self, ops):
+        request = bytearray()
+        for op in ops:
+            if len(op) == 2:
+                addr, width = op
+                request += bytes([addr, 0x80 | width])
+            else:
+                addr, width, value = op
+                request += bytes([addr, width]) + value.to_bytes(width, byteorder="big")
+        await self.control_write(usb1.REQUEST_TYPE_VENDOR, REQ_REGISTER_BATCH, 0, 0, request)
+        response = await self.control_read(usb1.REQUEST_TYPE_VENDOR, REQ_REGISTER_BATCH,
+                                           0, 0, 64)
+
+        results = []
+        offset  = 0
+        for op in ops:
+            if not response[offset]:
+                await self._register_error(op[0])
+            offset += 1
+            if len(op) == 2:
+                addr, width = op
+                value = int.from_bytes(response[offset:offset + width], byteorder="little")
+                logger.trace("register %d read: %#04x", addr, value)
+                results.append(value)
+                offset += width
+            else:
+                addr, width, value = op
+                logger.trace("register %d write: %#04x", addr, value)
+                results.append(None)
+        return results
+
+    async def register_batch(self, ops):
+        """
+        Perform a sequence of FPGA register operations, with as few USB round trips as possible.
+
+        Each operation in ``ops`` is either ``(addr, width)``, which reads the ``width``-byte
+        register at ``addr``, or ``(addr, width, value)``, which writes ``value`` to it.
+        Returns a list with the value read by each read operation, and ``None`` for each write
+        operation.
+        """
+        if self._register_tunnel:
+            # The gateware stops executing commands when its IN FIFO is full, and the response is
+            # only read once the whole request is sent, so it must fit into the IN FIFO.
+            max_request_length = None
+            max_response_length = 511
+            op_overhead = 3, 0
+            batch_fn = self._tunnel_registers
+        else:
+            # The firmware accepts as many operations as fit into 64 bytes, and returns as many
+            # results as fit into 64 bytes.
+            max_request_length = max_response_length = 64
+            op_overhead = 2, 1
+            batch_fn = self._register_batch
+
+        results = []
+        batch   = []
+        request_length = response_length = 0
+        for op in ops:
+            op_request_length  = op_overhead[0] + (op[1] if len(op) == 3 else 0)
+            op_response_length = op_overhead[1] + (op[1] if len(op) == 2 else 0)
+            if ((max_request_length is not None and
+                    request_length  + op_request_length  > max_request_length) or
+                    response_length + op_response_length > max_response_length):
+                results += await batch_fn(batch)
+                batch   = []
+                request_length = response_length = 0
+            batch.append(op)
+            request_length  += op_request_length
+            response_length += op_response_length
+        if batch:
+            results += await batch_fn(batch)
+        return results
+
+# -------------------------------------------------------------------------------------------------
+
+import os
+import unittest
+
+
+_FIRMWARE_DIR = os.path.join(os.path.dirname(__file__), "..", "..", "..", "firmware")
+
+
+class FirmwareImageTestCase(unittest.TestCase):
+    def test_api_level(self):
+        # The built-in firmware has to be rebuilt (with `make -C software`) whenever
+        # the firmware changes; otherwise, the host loads it and refuses the device it just
+        # loaded. The API level request stores the level into EP0BUF with
+        # `mov dptr, #EP0BUF; mov a, #level; movx @dptr, a`.
+        image = bytearray(0x4000)
+        for address, data in GlasgowHardwareDevice.builtin_firmware():
+            image[address:address + len(data)] = data
+        levels = [match.group(1)[0]
+                  for match in re.finditer(rb"\x90\xe7\x40\x74(.)\xf0", image, re.S)]
+        self.assertIn(CUR_API_LEVEL, levels,
+                      "firmware.ihex is out of date; rebuild it with `make -C software`")
+
+
+@unittest.skipUnless(os.path.exists(os.path.join(_FIRMWARE_DIR, "main.c")),
+                     "firmware sources are not available")
+class FirmwareSetupHandlersTestCase(unittest.TestCase):
+    """
+    Check the vendor request table in the firmware against the requests the host sends,
+    by evaluating ``setup_handlers[]`` the way ``handle_pending_usb_setup()`` does.
+    """
+    @classmethod
+    def setUpClass(cls):
+        with open(os.path.join(_FIRMWARE_DIR, "glasgow.h")) as f:
+            header = f.read()
+        with open(os.path.join(_FIRMWARE_DIR, "main.c")) as f:
+            source = f.read()
+
+        symbols = {}
+        for name, value in re.findall(r"^#define\s+(\w+)\s+(\d+|0x[0-9A-Fa-f]+)\b",
+                                      header, re.M):
+            symbols[name] = int(value, 0)
+        for name, value in re.findall(r"^\s+(\w+)\s*=\s*((?:0x)?[0-9A-Fa-f]+|1<<\d+)\s*,",
+                                      header + source, re.M):
+            symbols[name] = eval(value)
+        symbols["FPGA_PHASE_COUNT"] = len(re.findall(r"^\s+FPGA_PHASE_(?!COUNT)\w+,",
+                                                     header, re.M))
+        symbols["sizeof(fpga_phase_ticks)"] = 4 * symbols["FPGA_PHASE_COUNT"]
+        symbols["sizeof(reg_poll)"] = struct.calcsize("<BBBHH")
+        cls.symbols = symbols
+
+        def evaluate(expr):
+            for name in sorted(symbols, key=len, reverse=True):
+                expr = expr.replace(name, str(symbols[name]))
+            return eval(expr, {"__builtins__": {}})
+
+        table = re.search(r"setup_handlers\[\] = \{(.*?)\n\};", source, re.S).group(1)
+        cls.handlers = {}
+        for index, flags, min_length, max_length in re.findall(
+                r"\[(\w+)\s*- USB_REQ_API_LEVEL\]\s*=\s*"
+                r"SETUP_HANDLER\(\w+,\s*([\w|]+),\s*([^,]+?),\s*([^,]+?)\),",
+                table, re.S):
+            cls.handlers[symbols[index]] = (
+                evaluate(flags), evaluate(min_length), evaluate(max_length))
+
+    def accepts(self, request, is_in, length):
+        if request not in self.handlers:
+            return False
+        flags, min_length, max_length = self.handlers[request]
+        direction = self.symbols["SETUP_IN"] if is_in else self.symbols["SETUP_OUT"]
+        return bool(flags & direction) and min_length <= length <= max_length
+
+    def test_request_codes(self):
+        self.assertEqual(self.symbols["CUR_API_LEVEL"], CUR_API_LEVEL)
+        for name, value in globals().items():
+            if name.startswith("REQ_") and name != "REQ_RAM":
+                self.assertEqual(self.symbols["USB_" + name], value, name)
+                self.assertIn(value, self.handlers, name)
+
+    def test_host_requests(self):
+        for request, is_in, length in [
+            (REQ_API_LEVEL,       True,  1),
+            (REQ_EEPROM,          True,  0x1000),
+            (REQ_EEPROM,          False, 0x1000),
+            (REQ_FPGA_CFG,        False, 0),
+            (REQ_FPGA_CFG,        False, 1024),
+            (REQ_STATUS,          True,  1),
+            (REQ_REGISTER,        True,  4),
+            (REQ_REGISTER,        False, 4),
+            (REQ_IO_VOLT,         True,  2),
+            (REQ_IO_VOLT,         False, 2),
+            (REQ_SENSE_VOLT,      True,  2),
+            (REQ_ALERT_VOLT,      True,  4),
+            (REQ_ALERT_VOLT,      False, 4),
+            (REQ_POLL_ALERT,      True,  1),
+            (REQ_BITSTREAM_ID,    True,  16),
+            (REQ_BITSTREAM_ID,    False, 16),
+            (REQ_IOBUF_ENABLE,    False, 0),
+            (REQ_LIMIT_VOLT,      True,  2),
+            (REQ_LIMIT_VOLT,      False, 2),
+            (REQ_PULL,            False, 2),
+            (REQ_FPGA_CFG_BULK,   False, 4),
+            (REQ_FPGA_CFG_BULK,   False, 4 + 16),
+            (REQ_BITSTREAM_SLOT,  False, 16),
+            (REQ_FPGA_TIMING,     True,  12),
+            (REQ_EEPROM_BULK,     False, 4),
+            (REQ_EEPROM_PAGES,    True,  2),
+            (REQ_REGISTER_BATCH,  True,  64),
+            (REQ_REGISTER_BATCH,  False, 64),
+            (REQ_REGISTER_POLL,   True,  3),
+            (REQ_REGISTER_POLL,   False, struct.calcsize("<BBBHH")),
+            (REQ_REGISTER_SHADOW, False, 16),
+            (REQ_REGISTER_SAMPLE, True,  2 + 512),
+            (REQ_REGISTER_SAMPLE, False, 4 + 2 * 8),
+            (REQ_FIFO_FLAGS,      False, 0),
+            (REQ_FIFO_FLUSH,      False, 0),
+        ]:
+            self.assertTrue(self.accepts(request, is_in, length),
+                            "{:#04x} {} {}".format(request, "IN" if is_in else "OUT", length))
+
+    def test_direction(self):
+        for request, is_in in [
+            (REQ_API_LEVEL,       False),
+            (REQ_FPGA_CFG,        True),
+            (REQ_STATUS,          False),
+            (REQ_SENSE_VOLT,      False),
+            (REQ_POLL_ALERT,      False),
+            (REQ_IOBUF_ENABLE,    True),
+            (REQ_FPGA_CFG_BULK,   True),
+            (REQ_BITSTREAM_SLOT,  True),
+            (REQ_FPGA_TIMING,     False),
+            (REQ_EEPROM_BULK,     True),
+            (REQ_EEPROM_PAGES,    False),
+            (REQ_REGISTER_SHADOW, True),
+            (REQ_FIFO_FLAGS,      True),
+            (REQ_FIFO_FLUSH,      True),
+        ]:
+            _, min_length, _ = self.handlers[request]
+            self.assertFalse(self.accepts(request, is_in, min_length),
+                             "{:#04x} {}".format(request, "IN" if is_in else "OUT"))
+
+    def test_length(self):
+        for request, is_in, length in [
+            (REQ_API_LEVEL,       True,  0),
+            (REQ_API_LEVEL,       True,  2),
+            (REQ_STATUS,          True,  2),
+            (REQ_IO_VOLT,         False, 1),
+            (REQ_ALERT_VOLT,      True,  3),
+            (REQ_BITSTREAM_ID,    True,  15),
+            (REQ_BITSTREAM_ID,    False, 17),
+            (REQ_IOBUF_ENABLE,    False, 1),
+            (REQ_FPGA_CFG_BULK,   False, 3),
+            (REQ_FPGA_CFG_BULK,   False, 4 + 16 + 1),
+            (REQ_BITSTREAM_SLOT,  False, 15),
+            (REQ_FPGA_TIMING,     True,  11),
+            (REQ_EEPROM_BULK,     False, 5),
+            (REQ_REGISTER_BATCH,  False, 65),
+            (REQ_REGISTER_POLL,   True,  2),
+            (REQ_REGISTER_POLL,   False, struct.calcsize("<BBBHH") + 1),
+            (REQ_REGISTER_SHADOW, False, 17),
+            (REQ_REGISTER_SAMPLE, False, 1),
+            (REQ_FIFO_FLAGS,      False, 1),
+        ]:
+            self.assertFalse(self.accepts(request, is_in, length),
+                             "{:#04x} {} {}".format(request, "IN" if is_in else "OUT", length))
+
+    def test_fpga(self):
+        # Requests that access the FPGA wait for a stored bitstream to be loaded; the rest must
+        # not, so that the host can watch the load and read the EEPROM meanwhile.
+        fpga_requests = {REQ_REGISTER, REQ_BITSTREAM_ID, REQ_REGISTER_BATCH, REQ_REGISTER_POLL,
+                         REQ_REGISTER_SHADOW}
+        for request, (flags, _, _) in self.handlers.items():
+            self.assertEqual(bool(flags & self.symbols["SETUP_FPGA"]), request in fpga_requests,
+                             "{:#04x}".format(request))
@@ -338,9 +338,13 @@ class FX2Crossbar(Module):
     The crossbar supports up to four FIFOs organized as ``OUT, OUT, IN, IN``.
     FIFOs that are never requested are not implemented and behave as if they
     are never readable or writable.
+
+    ``in_packet_sizes`` are the sizes of the FX2 buffers of the IN FIFOs, which must match
+    the USB configuration used with the gateware.
     """
-    def __init__(self, pads):
+    def __init__(self, pads, in_packet_sizes=(512, 512)):
         self.submodules.bus = _FX2Bus(pads)
+        self._in_packet_sizes = in_packet_sizes
 
         self.out_fifos = Array([_UnimplementedOUTFIFO(width=8)
                                 for _ in range(2)])
@@ -497,6 +501,7 @@ class FX2Crossbar(Module):
                                reset=reset,
                                depth=depth,
                                wrapper=lambda fifo: _INFIFO(fifo,
+                                    packet_size=self._in_packet_sizes[n],
                                     asynchronous=clock_domain is not None,
                                     auto_flush=auto_flush))
         setattr(self.submodules, f"in_fifo_{n}", fifo)
@@ -1,7 +1,7 @@
 from nmigen.compat import *
 
 
-__all__ = ["Registers", "I2CRegisters"]
+__all__ = ["Registers", "I2CRegisters", "TunnelRegisters"]
 
 
 class Registers(Module):
@@ -84,9 +84,122 @@ class I2CRegisters(Registers):
             )
         ]
 
+
+class TunnelRegisters(I2CRegisters):
+    """
+    A register array, accessible over I2C, and also over a pair of FIFOs connected to a pipe.
+
+    The OUT FIFO carries commands. Each command starts with a 3-byte header: an opcode,
+    a register address, and a byte count.
+
+    * ``OP_WRITE``: the header is followed by the data, in big endian, as for I2C.
+    * ``OP_READ``: the data is sent to the IN FIFO, in little endian, as for I2C.
+    * ``OP_SYNC``: a single zero byte is sent to the IN FIFO once all preceding commands have been
+      executed; the address and the byte count are ignored.
+
+    Unlike with I2C, accessing a register that does not exist is not an error; such writes are
+    ignored, and such reads return zeroes.
+
+    :attr reset:
+        Command processing reset. Does not reset the FIFOs.
+    """
+    OP_WRITE = 0x00
+    OP_READ  = 0x01
+    OP_SYNC  = 0x02
+
+    def __init__(self, i2c_target, out_fifo, in_fifo):
+        super().__init__(i2c_target)
+        self.out_fifo = out_fifo
+        self.in_fifo  = in_fifo
+        self.reset    = Signal()
+
+    def do_finalize(self):
+        super().do_finalize()
+        if self.reg_count == 0:
+            return
+
+        out_fifo = self.out_fifo
+        in_fifo  = self.in_fifo
+
+        opcode   = Signal(8)
+        reg_addr = Signal(8)
+        reg_data = Signal(max(8, max(s.nbits for s in self.regs_r)))
+        count    = Signal(8)
+        valid    = Signal()
+        write    = Signal()
+        self.comb += valid.eq(reg_addr < self.reg_count)
+        self.sync += [
+            If(write & valid,
+                self.regs_w[reg_addr].eq(Cat(out_fifo.dout, reg_data))
+            )
+        ]
+
+        self.submodules.tunnel_fsm = fsm = ResetInserter()(FSM(reset_state="OPCODE"))
+        self.comb += fsm.reset.eq(self.reset)
+        fsm.act("OPCODE",
+            If(out_fifo.readable,
+                out_fifo.re.eq(1),
+                NextValue(opcode, out_fifo.dout),
+                NextState("ADDRESS")
+            )
+        )
+        fsm.act("ADDRESS",
+            If(out_fifo.readable,
+                out_fifo.re.eq(1),
+                NextValue(reg_addr, out_fifo.dout),
+                NextState("COUNT")
+            )
+        )
+        fsm.act("COUNT",
+            If(out_fifo.readable,
+                out_fifo.re.eq(1),
+                NextValue(count, out_fifo.dout),
+                NextValue(reg_data, Mux(valid, self.regs_r[reg_addr], 0)),
+                If(opcode == self.OP_SYNC,
+                    NextState("SYNC")
+                ).Elif(out_fifo.dout == 0,
+                    NextState("OPCODE")
+                ).Elif(opcode == self.OP_READ,
+                    NextState("READ")
+                ).Else(
+                    NextState("WRITE")
+                )
+            )
+        )
+        fsm.act("WRITE",
+            If(out_fifo.readable,
+                out_fifo.re.eq(1),
+                write.eq(1),
+                NextValue(reg_data, Cat(out_fifo.dout, reg_data)),
+                NextValue(count, count - 1),
+                If(count == 1,
+                    NextState("OPCODE")
+                )
+            )
+        )
+        fsm.act("READ",
+            in_fifo.din.eq(reg_data[:8]),
+            If(in_fifo.writable,
+                in_fifo.we.eq(1),
+                NextValue(reg_data, reg_data >> 8),
+                NextValue(count, count - 1),
+                If(count == 1,
+                    NextState("OPCODE")
+                )
+            )
+        )
+        fsm.act("SYNC",
+            in_fifo.din.eq(0),
+            If(in_fifo.writable,
+                in_fifo.we.eq(1),
+                NextState("OPCODE")
+            )
+        )
+
 # -------------------------------------------------------------------------------------------------
 
 import unittest
+from nmigen.compat.genlib.fifo import SyncFIFOBuffered
 
 from . import simulation_test
 from .i2c import I2CTargetTestbench
@@ -217,3 +330,81 @@ class I2CRegistersTestCase(unittest.TestCase):
         self.assertEqual((yield from tb.i2c.read_octet()), 0b00001110)
         yield from tb.i2c.write_bit(1)
         yield from tb.i2c.stop()
+
+
+class TunnelRegistersTestbench(Module):
+    def __init__(self):
+        self.submodules.i2c      = I2CTargetTestbench()
+        self.submodules.out_fifo = SyncFIFOBuffered(width=8, depth=16)
+        self.submodules.in_fifo  = SyncFIFOBuffered(width=8, depth=16)
+        self.submodules.dut = TunnelRegisters(self.i2c.dut, self.out_fifo, self.in_fifo)
+        self.reg_rw_8,  self.addr_rw_8  = self.dut.add_rw(8)
+        self.reg_ro_8,  self.addr_ro_8  = self.dut.add_ro(8)
+        self.reg_rw_16, self.addr_rw_16 = self.dut.add_rw(16)
+        self.reg_ro_12, self.addr_ro_12 = self.dut.add_ro(12)
+
+    def command(self, *data):
+        for byte in data:
+            yield from self.out_fifo.write(byte)
+
+    def response(self, count, limit=64):
+        data  = []
+        cycle = 0
+        while len(data) < count:
+            while not (yield self.in_fifo.readable) and cycle < limit:
+                yield
+                cycle += 1
+            if not (yield self.in_fifo.readable):
+                raise ValueError("FIFO underflow")
+            data.append((yield from self.in_fifo.read()))
+            yield
+        return data
+
+    def wait(self, cycles=16):
+        for _ in range(cycles):
+            yield
+
+
+class TunnelRegistersTestCase(unittest.TestCase):
+    def setUp(self):
+        self.tb = TunnelRegistersTestbench()
+
+    @simulation_test
+    def test_write_8(self, tb):
+        yield from tb.command(TunnelRegisters.OP_WRITE, self.tb.addr_rw_8, 1, 0b10100101)
+        yield from tb.wait()
+        self.assertEqual((yield tb.dut.regs_r[self.tb.addr_rw_8]), 0b10100101)
+
+    @simulation_test
+    def test_read_8(self, tb):
+        yield (tb.dut.regs_r[self.tb.addr_ro_8].eq(0b10100101))
+        yield from tb.command(TunnelRegisters.OP_READ, self.tb.addr_ro_8, 1)
+        self.assertEqual((yield from tb.response(1)), [0b10100101])
+
+    @simulation_test
+    def test_write_read_16(self, tb):
+        yield from tb.command(TunnelRegisters.OP_WRITE, self.tb.addr_rw_16, 2,
+                              0b11110000, 0b10100101)
+        yield from tb.command(TunnelRegisters.OP_READ, self.tb.addr_rw_16, 2)
+        self.assertEqual((yield from tb.response(2)), [0b10100101, 0b11110000])
+        self.assertEqual((yield tb.dut.regs_r[self.tb.addr_rw_16]), 0b1111000010100101)
+
+    @simulation_test
+    def test_read_12(self, tb):
+        yield (tb.dut.regs_r[self.tb.addr_ro_12].eq(0b111010100101))
+        yield from tb.command(TunnelRegisters.OP_READ, self.tb.addr_ro_12, 2)
+        self.assertEqual((yield from tb.response(2)), [0b10100101, 0b00001110])
+
+    @simulation_test
+    def test_sync(self, tb):
+        yield from tb.command(TunnelRegisters.OP_WRITE, self.tb.addr_rw_8, 1, 0b10100101)
+        yield from tb.command(TunnelRegisters.OP_SYNC, 0, 0)
+        self.assertEqual((yield from tb.response(1)), [0])
+        self.assertEqual((yield tb.dut.regs_r[self.tb.addr_rw_8]), 0b10100101)
+
+    @simulation_test
+    def test_nonexistent(self, tb):
+        yield from tb.command(TunnelRegisters.OP_WRITE, 10, 1, 0b10100101)
+        yield from tb.command(TunnelRegisters.OP_READ, 10, 1)
+        self.assertEqual((yield from tb.response(1)), [0])
+        self.assertEqual((yield tb.dut.regs_r[self.tb.addr_rw_8]), 0)
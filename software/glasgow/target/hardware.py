@@ -9,7 +9,7 @@ from nmigen.build import ResourceError
 
 from ..gateware.pads import Pads
 from ..gateware.i2c import I2CTarget
-from ..gateware.registers import I2CRegisters
+from ..gateware.registers import I2CRegisters, TunnelRegisters
 from ..gateware.fx2_crossbar import FX2Crossbar
 from ..platform.all import *
 from .analyzer import GlasgowAnalyzer
@@ -22,7 +22,8 @@ logger = logging.getLogger(__name__)
 
 
 class GlasgowHardwareTarget(Module):
-    def __init__(self, revision, multiplexer_cls=None, with_analyzer=False):
+    def __init__(self, revision, multiplexer_cls=None, with_analyzer=False,
+                 with_register_tunnel=False, with_isochronous_in=False):
         if revision in ("A0", "B0"):
             self.platform = GlasgowPlatformRevAB()
             self.sys_clk_freq = 30e6
@@ -41,12 +42,34 @@ class GlasgowHardwareTarget(Module):
             pass
 
         self.submodules.i2c_target = I2CTarget(self.platform.request("i2c"))
-        self.submodules.registers = I2CRegisters(self.i2c_target)
         self.comb += self.i2c_target.address.eq(0b0001000)
 
+        # With an isochronous EP6IN, the IN packets of pipe P are 1024 bytes long.
         self.submodules.fx2_crossbar = FX2Crossbar(self.platform.request("fx2", xdr={
             "sloe": 1, "slrd": 1, "slwr": 1, "pktend": 1, "fifoadr": 1, "flag": 2, "fd": 2
-        }))
+        }), in_packet_sizes=(1024, 512) if with_isochronous_in else (512, 512))
+
+        if with_register_tunnel:
+            # Pipe Q carries register commands instead of applet data. The tunnel is held in reset
+            # until the host opens it (over I2C), so that any stale commands are discarded.
+            tunnel_reset = Signal(reset=1)
+            self.submodules.registers = TunnelRegisters(self.i2c_target,
+                out_fifo=self.fx2_crossbar.get_out_fifo(1, reset=tunnel_reset),
+                in_fifo=self.fx2_crossbar.get_in_fifo(1, reset=tunnel_reset))
+            reset, self.addr_register_tunnel_reset = self.registers.add_rw(1, reset=1)
+            self.comb += [
+                tunnel_reset.eq(reset),
+                self.registers.reset.eq(reset),
+            ]
+            pipes = "P"
+        else:
+            self.submodules.registers = I2CRegisters(self.i2c_target)
+            self.addr_register_tunnel_reset = None
+            pipes = "PQ"
+        if with_isochronous_in:
+            # The USB configuration with an isochronous EP6IN only has pipe P.
+            assert not with_register_tunnel
+            pipes = "P"
 
         self.ports = {
             "A": (8, lambda n: self.platform.request("port_a", n)),
@@ -54,8 +77,7 @@ class GlasgowHardwareTarget(Module):
         }
 
         if multiplexer_cls:
-            pipes = "PQ"
-            self.submodules.multiplexer = multiplexer_cls(ports=self.ports, pipes="PQ",
+            self.submodules.multiplexer = multiplexer_cls(ports=self.ports, pipes=pipes,
                 registers=self.registers, fx2_crossbar=self.fx2_crossbar)
         else:
             self.multiplexer = None